@@ -1,73 +1,436 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /*fallocate and its hole punching flags*/
+#endif
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+/*A run of adjacent blocks serviced as a single request*/
+typedef struct block_run
+{
+    int address;
+    int nblocks;
+    int first; /*index of the run's first entry in the sorted vector*/
+} block_run;
+
+/*An emulated device: one image file and the model of its timing*/
+struct disk
+{
+    FILE* fp;
+    int fd;
+    int mode;
+    char* map;
+    size_t map_size;
+    int block_size;
+    int max_block;
+
+    disk_model model;
+    pthread_mutex_t model_lock;
+    double model_clock;                  /*simulated time in microseconds*/
+    double model_epoch;                  /*wall clock at which the model was installed*/
+    double model_slots[DISK_MAX_QUEUE_DEPTH]; /*time at which each queue slot goes idle*/
+    int model_head;                      /*block following the last request serviced*/
+    disk_stats stats;
+};
+
+/*Device model: zero cost unless a profile is installed with disk_set_model*/
+const disk_model DISK_MODEL_NONE = {0, 0, 0, 0, 1, 1};
+const disk_model DISK_MODEL_HDD = {8000, 9000, 7, 7, 1, 1};
+const disk_model DISK_MODEL_SSD = {80, 25, 0.5, 1, 32, 1};
+
+/*The device behind the calls that take no disk*/
+static disk_t default_disk = {NULL, -1, DISK_MODE_STDIO, NULL, 0, 0, 0, {0, 0, 0, 0, 1, 1}, PTHREAD_MUTEX_INITIALIZER, 0, 0, {0}, -1, {0}};
+
+/*----------------------------------------------------------*/
+/*Creates a device with no image open and no model installed */
+/*----------------------------------------------------------*/
+disk_t *disk_new()
+{
+    disk_t *disk = calloc(1, sizeof(disk_t));
+    if (disk == NULL)
+    {
+        return NULL;
+    }
+    disk->fd = -1;
+    disk->mode = DISK_MODE_STDIO;
+    disk->model = DISK_MODEL_NONE;
+    disk->model_head = -1;
+    pthread_mutex_init(&disk->model_lock, NULL);
+    return disk;
+}
+
+/*----------------------------------------------------------*/
+/*Closes the image of a device and frees it                  */
+/*----------------------------------------------------------*/
+void disk_free(disk_t *disk)
+{
+    if (disk == NULL || disk == &default_disk)
+    {
+        return;
+    }
+    disk_close(disk);
+    pthread_mutex_destroy(&disk->model_lock);
+    free(disk);
+}
+
+/*----------------------------------------------------------*/
+/*The device used by the calls that take no disk             */
+/*----------------------------------------------------------*/
+disk_t *get_default_disk()
+{
+    return &default_disk;
+}
+
+/*----------------------------------------------------------*/
+/*Microseconds since the model was installed. In virtual     */
+/*time this is the simulated clock, otherwise the wall clock */
+/*----------------------------------------------------------*/
+static double model_now(disk_t *disk)
+{
+    struct timespec ts;
+
+    if (disk->model.virtual_time)
+    {
+        return disk->model_clock;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3 - disk->model_epoch;
+}
+
+/*----------------------------------------------------------*/
+/*Installs a device model and restarts the simulated clock  */
+/*----------------------------------------------------------*/
+void disk_set_model(disk_t *disk, const disk_model *m)
+{
+    pthread_mutex_lock(&disk->model_lock);
+    disk->model = *m;
+    if (disk->model.queue_depth < 1)
+    {
+        disk->model.queue_depth = 1;
+    }
+    if (disk->model.queue_depth > DISK_MAX_QUEUE_DEPTH)
+    {
+        disk->model.queue_depth = DISK_MAX_QUEUE_DEPTH;
+    }
+    disk->model_clock = 0;
+    disk->model_epoch = 0;
+    disk->model_epoch = model_now(disk);
+    memset(disk->model_slots, 0, sizeof(disk->model_slots));
+    disk->model_head = -1;
+    memset(&disk->stats, 0, sizeof(disk->stats));
+    pthread_mutex_unlock(&disk->model_lock);
+}
+
+/*----------------------------------------------------------*/
+/*Current device time in microseconds                        */
+/*----------------------------------------------------------*/
+double disk_get_clock(disk_t *disk)
+{
+    pthread_mutex_lock(&disk->model_lock);
+    double now = model_now(disk);
+    pthread_mutex_unlock(&disk->model_lock);
+    return now;
+}
+
+disk_stats disk_get_stats(disk_t *disk)
+{
+    pthread_mutex_lock(&disk->model_lock);
+    disk_stats copy = disk->stats;
+    pthread_mutex_unlock(&disk->model_lock);
+    return copy;
+}
+
+/*-------------------------------------------------------------------*/
+/*Queues a request on the modelled device and returns the time it    */
+/*completes. A request that does not start where the previous one    */
+/*ended pays the seek cost. Requests submitted together run on       */
+/*separate queue slots, so up to queue_depth of them overlap.        */
+/*-------------------------------------------------------------------*/
+static double model_submit(disk_t *disk, int start_address, int nblocks, int write, double now)
+{
+    double cost = nblocks * (write ? disk->model.write_transfer_us : disk->model.read_transfer_us);
+    int seek = start_address != disk->model_head;
+    int slot = 0;
+
+    if (seek)
+    {
+        cost += write ? disk->model.write_seek_us : disk->model.read_seek_us;
+        disk->stats.seeks++;
+    }
+    for (int i = 1; i < disk->model.queue_depth; i++)
+    {
+        if (disk->model_slots[i] < disk->model_slots[slot])
+        {
+            slot = i;
+        }
+    }
+    double begin = disk->model_slots[slot] > now ? disk->model_slots[slot] : now;
+    disk->model_slots[slot] = begin + cost;
+    disk->model_head = start_address + nblocks;
+
+    if (write)
+    {
+        disk->stats.writes++;
+        disk->stats.blocks_written += nblocks;
+    }
+    else
+    {
+        disk->stats.reads++;
+        disk->stats.blocks_read += nblocks;
+    }
+    disk->stats.busy_us += cost;
+    return begin + cost;
+}
+
+/*-------------------------------------------------------------------*/
+/*Charges a batch of requests to the device model and blocks the      */
+/*caller until the last one completes: the simulated clock is         */
+/*advanced in virtual time, the caller sleeps for real otherwise      */
+/*-------------------------------------------------------------------*/
+static void model_access_runs(disk_t *disk, block_run *runs, int nruns, int write)
+{
+    pthread_mutex_lock(&disk->model_lock);
+    int virtual_time = disk->model.virtual_time;
+    double now = model_now(disk);
+    double done = now;
+    for (int i = 0; i < nruns; i++)
+    {
+        double run_done = model_submit(disk, runs[i].address, runs[i].nblocks, write, now);
+        if (run_done > done)
+        {
+            done = run_done;
+        }
+    }
+    if (virtual_time && done > disk->model_clock)
+    {
+        disk->model_clock = done;
+    }
+    pthread_mutex_unlock(&disk->model_lock);
+
+    double delay = done - now;
+    if (!virtual_time && delay > 0)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(delay / 1e6);
+        ts.tv_nsec = (long)((delay - ts.tv_sec * 1e6) * 1e3);
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void model_access(disk_t *disk, int start_address, int nblocks, int write)
+{
+    block_run run = {start_address, nblocks, 0};
+    model_access_runs(disk, &run, 1, write);
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
-int close_disk()
+int disk_close(disk_t *disk)
+{
+    if(NULL != disk->map)
+    {
+        msync(disk->map, disk->map_size, MS_SYNC);
+        munmap(disk->map, disk->map_size);
+        disk->map = NULL;
+    }
+    if(NULL != disk->fp)
+    {
+        fclose(disk->fp);
+        disk->fp = NULL;
+    }
+    if(-1 != disk->fd)
+    {
+        close(disk->fd);
+        disk->fd = -1;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Transfers a byte range at a fixed offset, retrying short transfers */
+/*Reads past the end of the image are returned as 0's, a write that */
+/*makes no progress fails                                            */
+/*-------------------------------------------------------------------*/
+static int pio_transfer(disk_t *disk, char *buffer, size_t length, off_t offset, int write)
 {
-    if(NULL != fp)
+    size_t done = 0;
+    while (done < length)
     {
-        fclose(fp);
+        ssize_t n = write ? pwrite(disk->fd, buffer + done, length - done, offset + done)
+                          : pread(disk->fd, buffer + done, length - done, offset + done);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 || (n == 0 && write))
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            memset(buffer + done, 0, length - done);
+            break;
+        }
+        done += n;
     }
     return 0;
 }
 
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+/*-------------------------------------------------------------------*/
+/*Scatter/gather version of pio_transfer: one preadv/pwritev moves a  */
+/*whole run of blocks, resuming after partial transfers               */
+/*-------------------------------------------------------------------*/
+static int pio_transfer_vec(disk_t *disk, struct iovec *iov, int iovcnt, off_t offset, int write)
 {
-    int i, j;
+    while (iovcnt > 0)
+    {
+        int batch = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t n = write ? pwritev(disk->fd, iov, batch, offset) : preadv(disk->fd, iov, batch, offset);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 || (n == 0 && write))
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            for (int i = 0; i < iovcnt; i++)
+            {
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
+            }
+            break;
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+/*---------------------------------------------------------------*/
+/*Opens the disk file with the stdio or file descriptor backend  */
+/*---------------------------------------------------------------*/
+static int open_disk(disk_t *disk, char *filename, int mode, int fresh)
+{
+    disk->mode = mode;
+
+    if (disk->mode != DISK_MODE_STDIO)
+    {
+        disk->fd = open(filename, fresh ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+        return disk->fd == -1 ? -1 : 0;
+    }
+    disk->fp = fopen (filename, fresh ? "w+b" : "r+b");
+    if (disk->fp == NULL)
+    {
+        return -1;
+    }
+    /*Lets writes accumulate in the stream until the next sync*/
+    setvbuf(disk->fp, NULL, _IOFBF, DISK_STDIO_BUFFER);
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Maps the whole image into memory for the mmap backend          */
+/*---------------------------------------------------------------*/
+static int map_disk(disk_t *disk)
+{
+    struct stat st;
 
-    if (fp == NULL)
+    if (disk->mode != DISK_MODE_MMAP)
+    {
+        return 0;
+    }
+    disk->map_size = (size_t)disk->max_block * disk->block_size;
+
+    /*Touching a page past the end of the file would raise SIGBUS*/
+    if (fstat(disk->fd, &st) == -1 || ((size_t)st.st_size < disk->map_size && ftruncate(disk->fd, disk->map_size) == -1))
+    {
+        return -1;
+    }
+    disk->map = mmap(NULL, disk->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (disk->map == MAP_FAILED)
+    {
+        disk->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Initializes a disk file filled with 0's                        */
+/*The image is created sparse, so never written blocks read as 0 */
+/*without the file ever being filled                             */
+/*---------------------------------------------------------------*/
+int disk_init_fresh(disk_t *disk, char *filename, int block_size, int num_blocks, int mode)
+{
+    off_t size = (off_t)num_blocks * block_size;
+    int preallocate = mode & DISK_PREALLOCATE;
+
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
+
+    /*Creates a new file*/
+    if (open_disk(disk, filename, mode & ~DISK_PREALLOCATE, 1) == -1)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+
+    /*Sizes the file in constant time, optionally reserving its space up front*/
+    int image = disk->mode == DISK_MODE_STDIO ? fileno(disk->fp) : disk->fd;
+    if (ftruncate(image, size) == -1 || (preallocate && posix_fallocate(image, 0, size) != 0))
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not size new disk file %s\n\n", filename);
+        disk_close(disk);
+        return -1;
+    }
+    if (map_disk(disk) == -1)
+    {
+        printf("Could not map disk file %s\n\n", filename);
+        disk_close(disk);
+        return -1;
     }
     return 0;
 }
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+int disk_init(disk_t *disk, char *filename, int block_size, int num_blocks, int mode)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
 
-    if (fp == NULL)
+    /*Opens a file*/
+    if (open_disk(disk, filename, mode, 0) == -1 || map_disk(disk) == -1)
     {
         printf("Could not open %s\n\n", filename);
+        disk_close(disk);
         return -1;
     }
     return 0;
@@ -76,32 +439,57 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int disk_read_blocks(disk_t *disk, int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address < 0 || start_address + nblocks > disk->max_block)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
+    /*Pause until the modelled device finishes the request*/
+    model_access(disk, start_address, nblocks, 0);
+
+    /*Mapped reads are a single copy straight out of the page cache*/
+    if (disk->mode == DISK_MODE_MMAP)
+    {
+        memcpy(buffer, disk->map + (size_t)start_address * disk->block_size, (size_t)nblocks * disk->block_size);
+        return nblocks;
+    }
+
+    /*Positional reads do not share a seek pointer and need no temporary buffer*/
+    if (disk->mode == DISK_MODE_PIO)
+    {
+        if (pio_transfer(disk, buffer, (size_t)nblocks * disk->block_size, (off_t)start_address * disk->block_size, 0) == -1)
+        {
+            printf("read error %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    /*Sets up a temporary buffer*/
+    void* blockRead = (void*) malloc(disk->block_size);
+
+    /*Holds the stream lock so the seek and the reads happen as one operation*/
+    flockfile(disk->fp);
+
     /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    fseeko(disk->fp, (off_t)start_address * disk->block_size, SEEK_SET);
 
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        fread(blockRead, disk->block_size, 1, disk->fp);
+        memcpy((char *)buffer+(i*disk->block_size), blockRead, disk->block_size);
     }
 
+    funlockfile(disk->fp);
     free(blockRead);
     return s;
 }
@@ -109,35 +497,384 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int disk_write_blocks(disk_t *disk, int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address < 0 || start_address + nblocks > disk->max_block)
     {
         printf("out of bound error\n");
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (disk->mode != DISK_MODE_STDIO)
+    {
+        /*Pause until the modelled device finishes the request*/
+        model_access(disk, start_address, nblocks, 1);
+        if (disk->mode == DISK_MODE_MMAP)
+        {
+            memcpy(disk->map + (size_t)start_address * disk->block_size, buffer, (size_t)nblocks * disk->block_size);
+            return nblocks;
+        }
+        if (pio_transfer(disk, buffer, (size_t)nblocks * disk->block_size, (off_t)start_address * disk->block_size, 1) == -1)
+        {
+            printf("write error %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    /*Pause until the modelled device finishes the request*/
+    model_access(disk, start_address, nblocks, 1);
+
+    void* blockWrite = (void*) malloc(disk->block_size);
+
+    /*Holds the stream lock so the seek and the writes happen as one operation*/
+    flockfile(disk->fp);
 
-    /*For every block requested*/        
+    /*Goto where the data is to be written on the disk*/
+    fseeko(disk->fp, (off_t)start_address * disk->block_size, SEEK_SET);
+
+    /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+        memcpy(blockWrite, (char *)buffer+(i*disk->block_size), disk->block_size);
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
+        fwrite(blockWrite, disk->block_size, 1, disk->fp);
         s++;
     }
+    funlockfile(disk->fp);
     free(blockWrite);
     return s;
 }
+
+/*------------------------------------------------------------------*/
+/*Returns a pointer to a block inside the mapped image, or NULL when */
+/*the disk is not opened with the mmap backend                       */
+/*------------------------------------------------------------------*/
+void *disk_map_block(disk_t *disk, int address)
+{
+    if (disk->map == NULL || address < 0 || address >= disk->max_block)
+    {
+        return NULL;
+    }
+    return disk->map + (size_t)address * disk->block_size;
+}
+
+/*------------------------------------------------------------------*/
+/*Finds where a run of blocks lies in the image file, so a caller    */
+/*can move it with splice instead of through a buffer. The request   */
+/*is charged to the device model like a read or a write. Not offered */
+/*by the stdio backend, whose stream may hold writes the file lacks  */
+/*------------------------------------------------------------------*/
+int disk_locate_blocks(disk_t *disk, int start_address, int nblocks, int write, int *fd, long long *offset)
+{
+    if (start_address < 0 || start_address + nblocks > disk->max_block)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+    if (disk->mode == DISK_MODE_STDIO)
+    {
+        return -1;
+    }
+
+    /*Pause until the modelled device finishes the request*/
+    model_access(disk, start_address, nblocks, write);
+
+    *fd = disk->fd;
+    *offset = (long long)start_address * disk->block_size;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Makes a range of blocks durable on the image file                 */
+/*------------------------------------------------------------------*/
+int disk_sync_blocks(disk_t *disk, int start_address, int nblocks)
+{
+    if (start_address < 0 || start_address + nblocks > disk->max_block)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+    if (disk->mode == DISK_MODE_MMAP)
+    {
+        /*msync wants a page aligned start address*/
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = (size_t)start_address * disk->block_size;
+        size_t end = start + (size_t)nblocks * disk->block_size;
+        start -= start % page;
+        return msync(disk->map + start, end - start, MS_SYNC);
+    }
+    if (disk->mode == DISK_MODE_PIO)
+    {
+        return fdatasync(disk->fd);
+    }
+    if (fflush(disk->fp) != 0)
+    {
+        return -1;
+    }
+    return fsync(fileno(disk->fp));
+}
+
+/*------------------------------------------------------------------*/
+/*Makes every write issued so far durable on the image file         */
+/*------------------------------------------------------------------*/
+int disk_sync(disk_t *disk)
+{
+    return disk_sync_blocks(disk, 0, disk->max_block);
+}
+
+/*------------------------------------------------------------------*/
+/*Punches a hole over a range of blocks that are no longer in use,  */
+/*the image file equivalent of a TRIM. The blocks read as 0's after */
+/*------------------------------------------------------------------*/
+int disk_discard_blocks(disk_t *disk, int start_address, int nblocks)
+{
+    if (start_address < 0 || start_address + nblocks > disk->max_block)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    /*Buffered writes to the range must not land after the hole*/
+    if (disk->mode == DISK_MODE_STDIO && fflush(disk->fp) != 0)
+    {
+        return -1;
+    }
+    int image = disk->mode == DISK_MODE_STDIO ? fileno(disk->fp) : disk->fd;
+    return fallocate(image, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start_address * disk->block_size, (off_t)nblocks * disk->block_size);
+#else
+    return -1;
+#endif
+}
+
+/*------------------------------------------------------------------*/
+/*Orders vector entries by block, keeping submission order between  */
+/*entries for the same block so the last write still wins           */
+/*------------------------------------------------------------------*/
+static int compare_vec(const void *a, const void *b)
+{
+    const block_vec *x = *(block_vec * const *)a, *y = *(block_vec * const *)b;
+    if (x->address != y->address)
+    {
+        return x->address < y->address ? -1 : 1;
+    }
+    return x < y ? -1 : x > y; /*both point into the caller's vector*/
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers a list of (block, buffer) pairs, merging adjacent blocks */
+/*into single requests                                               */
+/*------------------------------------------------------------------*/
+static int transfer_vec(disk_t *disk, block_vec *vec, int count, int write)
+{
+    int nruns = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (vec[i].address < 0 || vec[i].address >= disk->max_block)
+        {
+            printf("out of bound error %d\n", vec[i].address);
+            return -1;
+        }
+    }
+    if (count <= 0)
+    {
+        return 0;
+    }
+
+    /*Only sorts when the caller did not already hand over ascending blocks*/
+    block_vec **sorted = malloc(count * sizeof(block_vec *));
+    int ascending = 1;
+    for (int i = 0; i < count; i++)
+    {
+        sorted[i] = &vec[i];
+        ascending = ascending && (i == 0 || vec[i].address > vec[i - 1].address);
+    }
+    if (!ascending)
+    {
+        qsort(sorted, count, sizeof(block_vec *), compare_vec);
+    }
+
+    block_run *runs = malloc(count * sizeof(block_run));
+    for (int i = 0; i < count; i++)
+    {
+        if (nruns > 0 && sorted[i]->address == runs[nruns - 1].address + runs[nruns - 1].nblocks)
+        {
+            runs[nruns - 1].nblocks++;
+            continue;
+        }
+        runs[nruns].address = sorted[i]->address;
+        runs[nruns].nblocks = 1;
+        runs[nruns].first = i;
+        nruns++;
+    }
+
+    /*Pause until the modelled device finishes the whole batch*/
+    model_access_runs(disk, runs, nruns, write);
+
+    int s = count;
+    if (disk->mode == DISK_MODE_STDIO)
+    {
+        flockfile(disk->fp);
+    }
+    for (int r = 0; r < nruns && s != -1; r++)
+    {
+        block_vec **run = sorted + runs[r].first;
+        off_t offset = (off_t)runs[r].address * disk->block_size;
+
+        if (disk->mode == DISK_MODE_MMAP)
+        {
+            for (int i = 0; i < runs[r].nblocks; i++)
+            {
+                char *block = disk->map + offset + (size_t)i * disk->block_size;
+                memcpy(write ? block : run[i]->buffer, write ? run[i]->buffer : block, disk->block_size);
+            }
+        }
+        else if (disk->mode == DISK_MODE_PIO)
+        {
+            struct iovec *iov = malloc(runs[r].nblocks * sizeof(struct iovec));
+            for (int i = 0; i < runs[r].nblocks; i++)
+            {
+                iov[i].iov_base = run[i]->buffer;
+                iov[i].iov_len = disk->block_size;
+            }
+            if (pio_transfer_vec(disk, iov, runs[r].nblocks, offset, write) == -1)
+            {
+                printf("%s error %d\n", write ? "write" : "read", runs[r].address);
+                s = -1;
+            }
+            free(iov);
+        }
+        else
+        {
+            fseeko(disk->fp, offset, SEEK_SET);
+            for (int i = 0; i < runs[r].nblocks; i++)
+            {
+                if (write)
+                {
+                    fwrite(run[i]->buffer, disk->block_size, 1, disk->fp);
+                }
+                else
+                {
+                    fread(run[i]->buffer, disk->block_size, 1, disk->fp);
+                }
+            }
+        }
+    }
+    if (disk->mode == DISK_MODE_STDIO)
+    {
+        funlockfile(disk->fp);
+    }
+
+    free(runs);
+    free(sorted);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads a list of blocks into their own buffers                     */
+/*------------------------------------------------------------------*/
+int disk_readv_blocks(disk_t *disk, block_vec *vec, int count)
+{
+    return transfer_vec(disk, vec, count, 0);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a list of blocks from their own buffers                    */
+/*------------------------------------------------------------------*/
+int disk_writev_blocks(disk_t *disk, block_vec *vec, int count)
+{
+    return transfer_vec(disk, vec, count, 1);
+}
+
+/*------------------------------------------------------------------*/
+/*The calls of a program with a single disk, all on the default one */
+/*------------------------------------------------------------------*/
+void set_disk_model(const disk_model *m)
+{
+    disk_set_model(&default_disk, m);
+}
+
+double disk_clock()
+{
+    return disk_get_clock(&default_disk);
+}
+
+disk_stats get_disk_stats()
+{
+    return disk_get_stats(&default_disk);
+}
+
+int close_disk()
+{
+    return disk_close(&default_disk);
+}
+
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    return init_fresh_disk_mode(filename, block_size, num_blocks, DISK_MODE_STDIO);
+}
+
+int init_fresh_disk_mode(char *filename, int block_size, int num_blocks, int mode)
+{
+    return disk_init_fresh(&default_disk, filename, block_size, num_blocks, mode);
+}
+
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    return init_disk_mode(filename, block_size, num_blocks, DISK_MODE_STDIO);
+}
+
+int init_disk_mode(char *filename, int block_size, int num_blocks, int mode)
+{
+    return disk_init(&default_disk, filename, block_size, num_blocks, mode);
+}
+
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_read_blocks(&default_disk, start_address, nblocks, buffer);
+}
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_write_blocks(&default_disk, start_address, nblocks, buffer);
+}
+
+int readv_blocks(block_vec *vec, int count)
+{
+    return disk_readv_blocks(&default_disk, vec, count);
+}
+
+int writev_blocks(block_vec *vec, int count)
+{
+    return disk_writev_blocks(&default_disk, vec, count);
+}
+
+void *map_block(int address)
+{
+    return disk_map_block(&default_disk, address);
+}
+
+int locate_blocks(int start_address, int nblocks, int write, int *fd, long long *offset)
+{
+    return disk_locate_blocks(&default_disk, start_address, nblocks, write, fd, offset);
+}
+
+int sync_blocks(int start_address, int nblocks)
+{
+    return disk_sync_blocks(&default_disk, start_address, nblocks);
+}
+
+int discard_blocks(int start_address, int nblocks)
+{
+    return disk_discard_blocks(&default_disk, start_address, nblocks);
+}
+
+int sync_disk()
+{
+    return disk_sync(&default_disk);
+}
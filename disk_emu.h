@@ -1,5 +1,87 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#define DISK_MODE_STDIO 0 /* shared FILE* with fseek, one I/O at a time */
+#define DISK_MODE_PIO 1   /* file descriptor with pread/pwrite, safe for concurrent I/O */
+#define DISK_MODE_MMAP 2  /* image mapped into memory, blocks reachable through map_block */
+#define DISK_PREALLOCATE 0x100 /* or'd into a fresh disk mode to reserve the image space with fallocate */
+
+#define DISK_MAX_QUEUE_DEPTH 64
+#define DISK_STDIO_BUFFER (64 * 1024) /* stream buffer writes accumulate in between syncs */
+
+/* One block of a scatter/gather request */
+typedef struct block_vec
+{
+    int address;
+    void *buffer; /* BLOCK_SIZE bytes */
+} block_vec;
+
+/* Latency model of the emulated device, all costs in microseconds */
+typedef struct disk_model
+{
+    double read_seek_us;      /* positioning cost of a read that does not follow the previous request */
+    double write_seek_us;     /* positioning cost of a non sequential write */
+    double read_transfer_us;  /* per block read */
+    double write_transfer_us; /* per block written */
+    int queue_depth;          /* requests the device services at the same time */
+    int virtual_time;         /* advance a simulated clock instead of sleeping */
+} disk_model;
+
+/* Counters accumulated since the model was last installed */
+typedef struct disk_stats
+{
+    long reads;
+    long writes;
+    long blocks_read;
+    long blocks_written;
+    long seeks;
+    double busy_us;
+} disk_stats;
+
+/* An emulated device, opened on one image file. Every process may hold any number of them */
+typedef struct disk disk_t;
+
+extern const disk_model DISK_MODEL_NONE;
+extern const disk_model DISK_MODEL_HDD;
+extern const disk_model DISK_MODEL_SSD;
+
+disk_t *disk_new();
+void disk_free(disk_t *disk);
+disk_t *get_default_disk();
+int disk_init_fresh(disk_t *disk, char *filename, int block_size, int num_blocks, int mode);
+int disk_init(disk_t *disk, char *filename, int block_size, int num_blocks, int mode);
+int disk_read_blocks(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_write_blocks(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_readv_blocks(disk_t *disk, block_vec *vec, int count);
+int disk_writev_blocks(disk_t *disk, block_vec *vec, int count);
+void *disk_map_block(disk_t *disk, int address);
+int disk_locate_blocks(disk_t *disk, int start_address, int nblocks, int write, int *fd, long long *offset);
+int disk_sync_blocks(disk_t *disk, int start_address, int nblocks);
+int disk_discard_blocks(disk_t *disk, int start_address, int nblocks);
+int disk_sync(disk_t *disk);
+int disk_close(disk_t *disk);
+void disk_set_model(disk_t *disk, const disk_model *model);
+double disk_get_clock(disk_t *disk);
+disk_stats disk_get_stats(disk_t *disk);
+
+/* The same calls on the default disk */
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
+int init_fresh_disk_mode(char *filename, int block_size, int num_blocks, int mode);
 int init_disk(char *filename, int block_size, int num_blocks);
+int init_disk_mode(char *filename, int block_size, int num_blocks, int mode);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int readv_blocks(block_vec *vec, int count);
+int writev_blocks(block_vec *vec, int count);
+void *map_block(int address);
+int locate_blocks(int start_address, int nblocks, int write, int *fd, long long *offset);
+int sync_blocks(int start_address, int nblocks);
+int discard_blocks(int start_address, int nblocks);
+int sync_disk();
 int close_disk();
+
+void set_disk_model(const disk_model *model);
+double disk_clock();
+disk_stats get_disk_stats();
+
+#endif
@@ -0,0 +1,755 @@
+#define FUSE_USE_VERSION 31
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include "sfs_api.h"
+
+// Front end on the low-level FUSE API. The kernel addresses files by inode number, so stat, open,
+// read and write reach the file system without a path or a name search, and the kernel caches
+// the names and attributes it looks up for the timeouts given. The root directory is
+// FUSE_ROOT_ID and a file is its SFS inode number plus FIRST_FILE_INO.
+
+#define FIRST_FILE_INO (FUSE_ROOT_ID + 1)
+#define FIRST_FILE_OFFSET 2 // readdir offsets 1 and 2 are "." and "..", then the directory slots follow
+#define DEFAULT_IMAGE "fs.sfs" // the image the path based front ends use
+#define MAX_TRANSFER (1024 * 1024) // largest read or write, libfuse lowers it to what its buffers hold
+
+typedef struct ll_inode
+{
+    uint64_t nlookup;    // references the kernel holds, taken by lookups and given back by forgets
+    uint64_t open;       // handles open on the file, from open or create until release
+    int unlinked;        // the name is gone, the file is freed once nlookup and open drop to 0
+    uint64_t generation; // bumped when a file is freed, as its number is reused
+} ll_inode;
+
+typedef struct ll_fs
+{
+    sfs_t *fs;
+    char *image;
+    int fresh;
+    double entry_timeout; // seconds the kernel may cache a name
+    double attr_timeout;  // seconds the kernel may cache the attributes of a file
+    ll_inode *inodes;     // one per SFS inode
+    int num_inodes;
+    pthread_mutex_t lock; // guards inodes
+} ll_fs;
+
+typedef struct ll_reply
+{
+    fuse_req_t req;
+    int replied; // set once the request is answered, so it is not answered twice
+} ll_reply;
+
+static const struct fuse_opt ll_opts[] = {
+    { "image=%s", offsetof(ll_fs, image), 0 },
+    { "fresh", offsetof(ll_fs, fresh), 1 },
+    { "entry_timeout=%lf", offsetof(ll_fs, entry_timeout), 0 },
+    { "attr_timeout=%lf", offsetof(ll_fs, attr_timeout), 0 },
+    FUSE_OPT_END
+};
+
+static ll_fs *get_ll(fuse_req_t req)
+{
+    return (ll_fs *)fuse_req_userdata(req);
+}
+
+/* SFS inode of a FUSE inode number, -1 for the root or a number out of range */
+static int sfs_inode(ll_fs *ll, fuse_ino_t ino)
+{
+    if (ino < FIRST_FILE_INO || ino - FIRST_FILE_INO >= (fuse_ino_t)ll->num_inodes)
+        return -1;
+
+    return ino - FIRST_FILE_INO;
+}
+
+/* SFS name of a file in the root directory, with the leading slash the path front ends store */
+static int sfs_name(const char *name, char *filename)
+{
+    if (strlen(name) + 1 >= MAXFILENAME)
+        return -ENAMETOOLONG;
+
+    filename[0] = '/';
+    strcpy(&filename[1], name);
+    return 0;
+}
+
+static void file_stat(ll_fs *ll, int inode, int size, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inode + FIRST_FILE_INO;
+    stbuf->st_mode = S_IFREG | 0666;
+    pthread_mutex_lock(&ll->lock);
+    stbuf->st_nlink = ll->inodes[inode].unlinked ? 0 : 1;
+    pthread_mutex_unlock(&ll->lock);
+    stbuf->st_size = size;
+}
+
+static void root_stat(struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = FUSE_ROOT_ID;
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+}
+
+/* Fills in the entry of a file, -1 if it no longer exists */
+static int fill_entry(ll_fs *ll, int inode, struct fuse_entry_param *e)
+{
+    int size = sfs_getinodesize_r(ll->fs, inode);
+
+    if (size == -1)
+        return -1;
+
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = inode + FIRST_FILE_INO;
+    pthread_mutex_lock(&ll->lock);
+    e->generation = ll->inodes[inode].generation;
+    pthread_mutex_unlock(&ll->lock);
+    file_stat(ll, inode, size, &e->attr);
+    e->attr_timeout = ll->attr_timeout;
+    e->entry_timeout = ll->entry_timeout;
+    return 0;
+}
+
+/* Counts references and handles the kernel takes, before replying so a forget cannot overtake them */
+static void ref_inode(ll_fs *ll, int inode, uint64_t nlookup, uint64_t open)
+{
+    pthread_mutex_lock(&ll->lock);
+    ll->inodes[inode].nlookup += nlookup;
+    ll->inodes[inode].open += open;
+    pthread_mutex_unlock(&ll->lock);
+}
+
+/* Gives back references and handles, freeing an unlinked file once the kernel holds neither */
+static void unref_inode(ll_fs *ll, int inode, uint64_t nlookup, uint64_t open)
+{
+    ll_inode *node = &ll->inodes[inode];
+    int last;
+
+    pthread_mutex_lock(&ll->lock);
+    node->nlookup -= nlookup < node->nlookup ? nlookup : node->nlookup;
+    node->open -= open < node->open ? open : node->open;
+    last = node->unlinked && node->nlookup == 0 && node->open == 0;
+    if (last) {
+        node->unlinked = 0; // freed once, by whoever lets go last
+        node->generation++;
+    }
+    pthread_mutex_unlock(&ll->lock);
+
+    if (last) // the kernel can no longer reach the file, so nothing races the release
+        sfs_iremove_r(ll->fs, inode);
+}
+
+static void forget_inode(ll_fs *ll, fuse_ino_t ino, uint64_t nlookup)
+{
+    int inode = sfs_inode(ll, ino);
+
+    if (inode != -1)
+        unref_inode(ll, inode, nlookup, 0);
+}
+
+/* Replies with a new entry, giving back the reference if the kernel never got it */
+static void reply_entry(fuse_req_t req, ll_fs *ll, int inode)
+{
+    struct fuse_entry_param e;
+
+    if (fill_entry(ll, inode, &e) == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    ref_inode(ll, inode, 1, 0);
+    if (fuse_reply_entry(req, &e) != 0)
+        forget_inode(ll, e.ino, 1);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    if (conn->capable & FUSE_CAP_READDIRPLUS)
+        conn->want |= FUSE_CAP_READDIRPLUS; // listing a directory looks its files up too
+
+    // reads are spliced out of the image into the kernel, writes from the kernel into the image
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+    if (conn->capable & FUSE_CAP_SPLICE_READ)
+        conn->want |= FUSE_CAP_SPLICE_READ;
+
+    // libfuse 3 always takes big writes, and sizes the largest read after max_write
+    conn->max_write = MAX_TRANSFER;
+}
+
+static void ll_destroy(void *userdata)
+{
+    ll_fs *ll = (ll_fs *)userdata;
+
+    sfs_sync_r(ll->fs); // write back the block cache before the file system goes away
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_fs *ll = get_ll(req);
+    struct fuse_entry_param e;
+    char filename[MAXFILENAME];
+    int inode;
+    int res;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((res = sfs_name(name, filename)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    inode = sfs_lookup_r(ll->fs, filename);
+    if (inode == -1) { // a negative entry, so the kernel caches the miss as well
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        e.entry_timeout = ll->entry_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    reply_entry(req, ll, inode);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    forget_inode(get_ll(req), ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    ll_fs *ll = get_ll(req);
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        forget_inode(ll, forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    ll_fs *ll = get_ll(req);
+    struct stat stbuf;
+    int inode;
+    int size;
+
+    if (ino == FUSE_ROOT_ID) {
+        root_stat(&stbuf);
+        fuse_reply_attr(req, &stbuf, ll->attr_timeout);
+        return;
+    }
+
+    inode = sfs_inode(ll, ino);
+    if (inode == -1 || (size = sfs_getinodesize_r(ll->fs, inode)) == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    file_stat(ll, inode, size, &stbuf);
+    fuse_reply_attr(req, &stbuf, ll->attr_timeout);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+        struct fuse_file_info *fi)
+{
+    ll_fs *ll = get_ll(req);
+    int inode = sfs_inode(ll, ino);
+    int fd;
+    int grow;
+    int res;
+
+    if (ino == FUSE_ROOT_ID) {
+        ll_getattr(req, ino, fi); // SFS keeps no modes, owners or times to set
+        return;
+    }
+    if (inode == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (attr->st_size > INT_MAX) {
+            fuse_reply_err(req, EFBIG);
+            return;
+        }
+        fd = fi != NULL ? (int)fi->fh : sfs_iopen_r(ll->fs, inode);
+        if (fd == -1) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        grow = attr->st_size > sfs_getinodesize_r(ll->fs, inode);
+        res = sfs_ftruncate_r(ll->fs, fd, attr->st_size);
+        if (fi == NULL)
+            sfs_fclose_r(ll->fs, fd);
+        if (res == -1) {
+            fuse_reply_err(req, grow ? ENOSPC : EIO);
+            return;
+        }
+    }
+
+    ll_getattr(req, ino, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    ll_fs *ll = get_ll(req);
+    int inode = sfs_inode(ll, ino);
+    int fd;
+
+    if (ino == FUSE_ROOT_ID) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    fd = inode == -1 ? -1 : sfs_iopen_r(ll->fs, inode);
+    if (fd == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    fi->fh = fd; // kept open until release, so reads and writes go straight to the fd
+    fi->keep_cache = 1; // every change goes through this process, so cached pages stay valid
+    ref_inode(ll, inode, 0, 1);
+    if (fuse_reply_open(req, fi) != 0) {
+        sfs_fclose_r(ll->fs, fd);
+        unref_inode(ll, inode, 0, 1);
+    }
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+        struct fuse_file_info *fi)
+{
+    ll_fs *ll = get_ll(req);
+    struct fuse_entry_param e;
+    char filename[MAXFILENAME];
+    int inode;
+    int fd;
+    int res;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((res = sfs_name(name, filename)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fd = fi->flags & O_EXCL ? sfs_fcreate_r(ll->fs, filename) : sfs_fopen_r(ll->fs, filename); // checked and created under one lock
+    if (fd == -1) {
+        fuse_reply_err(req, (fi->flags & O_EXCL) && sfs_lookup_r(ll->fs, filename) != -1 ? EEXIST : ENOSPC);
+        return;
+    }
+    inode = sfs_fileno_r(ll->fs, fd);
+    if (inode == -1 || fill_entry(ll, inode, &e) == -1) { // removed meanwhile
+        sfs_fclose_r(ll->fs, fd);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    fi->fh = fd; // closed by release, like a handle from open
+    fi->keep_cache = 1;
+    ref_inode(ll, inode, 1, 1);
+    if (fuse_reply_create(req, &e, fi) != 0) {
+        sfs_fclose_r(ll->fs, fd);
+        unref_inode(ll, inode, 1, 1);
+    }
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    ll_fs *ll = get_ll(req);
+    char filename[MAXFILENAME];
+    int inode;
+    int fd;
+    int res;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (!S_ISREG(mode)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    if ((res = sfs_name(name, filename)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fd = sfs_fcreate_r(ll->fs, filename);
+    if (fd == -1) {
+        fuse_reply_err(req, sfs_lookup_r(ll->fs, filename) != -1 ? EEXIST : ENOSPC);
+        return;
+    }
+    inode = sfs_fileno_r(ll->fs, fd);
+    sfs_fclose_r(ll->fs, fd);
+    if (inode == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    reply_entry(req, ll, inode);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_fs *ll = get_ll(req);
+    char filename[MAXFILENAME];
+    int inode;
+    int res;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((res = sfs_name(name, filename)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    inode = sfs_unlink_r(ll->fs, filename); // the file stays for the handles and references left
+    if (inode == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    pthread_mutex_lock(&ll->lock);
+    ll->inodes[inode].unlinked = 1;
+    pthread_mutex_unlock(&ll->lock);
+    unref_inode(ll, inode, 0, 0); // freed right away if the kernel holds neither
+    fuse_reply_err(req, 0);
+}
+
+/* Buffer vector over the extents of a file, those in the image read or written with splice */
+static struct fuse_bufvec *extents_bufvec(sfs_extent *extents, int count)
+{
+    struct fuse_bufvec *bufv;
+    int i;
+
+    bufv = malloc(sizeof(struct fuse_bufvec) + (count > 1 ? count - 1 : 0) * sizeof(struct fuse_buf));
+    if (bufv == NULL)
+        return NULL;
+
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = count;
+    for (i = 0; i < count; i++) {
+        bufv->buf[i].size = extents[i].length;
+        if (extents[i].mem != NULL) {
+            bufv->buf[i].flags = 0;
+            bufv->buf[i].mem = extents[i].mem;
+            bufv->buf[i].fd = -1;
+            bufv->buf[i].pos = 0;
+        } else {
+            bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            bufv->buf[i].mem = NULL;
+            bufv->buf[i].fd = extents[i].fd;
+            bufv->buf[i].pos = extents[i].pos;
+        }
+    }
+    return bufv;
+}
+
+/* Answers a read with the extents of the file, while SFS keeps them from changing */
+static int reply_extents(void *arg, sfs_extent *extents, int count)
+{
+    ll_reply *reply = (ll_reply *)arg;
+    struct fuse_bufvec *bufv;
+    int size;
+    int res;
+
+    reply->replied = 1;
+    if (count == 0)
+        return fuse_reply_buf(reply->req, NULL, 0) == 0 ? 0 : -1;
+
+    bufv = extents_bufvec(extents, count);
+    if (bufv == NULL) {
+        fuse_reply_err(reply->req, ENOMEM);
+        return -1;
+    }
+
+    size = fuse_buf_size(bufv);
+    res = fuse_reply_data(reply->req, bufv, FUSE_BUF_SPLICE_MOVE);
+    free(bufv);
+    return res == 0 ? size : -1;
+}
+
+/* Moves the data of a write request from the pipe it came in into the extents of the image */
+static int splice_extents(void *arg, sfs_extent *extents, int count)
+{
+    struct fuse_bufvec *src = (struct fuse_bufvec *)arg;
+    struct fuse_bufvec *dst;
+    ssize_t res;
+
+    dst = extents_bufvec(extents, count);
+    if (dst == NULL)
+        return -1;
+
+    res = fuse_buf_copy(dst, src, 0);
+    free(dst);
+    return res < 0 ? -1 : (int)res;
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    ll_fs *ll = get_ll(req);
+    ll_reply reply = { req, 0 };
+
+    if (offset > INT_MAX) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if (size > INT_MAX)
+        size = INT_MAX;
+
+    // answered from where the bytes lie, with no buffer in between
+    if (sfs_pread_extents_r(ll->fs, fi->fh, size, offset, reply_extents, &reply) == -1 && !reply.replied)
+        fuse_reply_err(req, EIO);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+        struct fuse_file_info *fi)
+{
+    ll_fs *ll = get_ll(req);
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    int res;
+
+    if (offset > INT_MAX || size > (size_t)(INT_MAX - offset)) {
+        fuse_reply_err(req, EFBIG);
+        return;
+    }
+
+    if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) { // in memory already, written from where it is
+        res = sfs_pwrite_r(ll->fs, fi->fh, (char *)bufv->buf[0].mem, size, offset);
+    } else { // still in the pipe: spliced over the blocks it replaces, or read out for a write that needs new ones
+        res = sfs_pwrite_extents_r(ll->fs, fi->fh, size, offset, splice_extents, bufv);
+        if (res == 0 && size > 0) {
+            buf.buf[0].mem = malloc(size);
+            if (buf.buf[0].mem == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+            }
+            res = fuse_buf_copy(&buf, bufv, 0) == (ssize_t)size
+                ? sfs_pwrite_r(ll->fs, fi->fh, (char *)buf.buf[0].mem, size, offset) : -1;
+            free(buf.buf[0].mem);
+        }
+    }
+
+    if (res == -1)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, sfs_fflush_r(get_ll(req)->fs, fi->fh) == -1 ? EIO : 0);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    ll_fs *ll = get_ll(req);
+    int inode = sfs_inode(ll, ino);
+
+    sfs_fclose_r(ll->fs, fi->fh);
+    if (inode != -1)
+        unref_inode(ll, inode, 0, 1);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, sfs_fsync_r(get_ll(req)->fs, fi->fh) == -1 ? EIO : 0);
+}
+
+/* Adds an entry to a directory listing, -1 if it does not fit in what is left of the buffer */
+static int add_entry(fuse_req_t req, char *buf, size_t size, size_t *used, const char *name,
+        const struct fuse_entry_param *e, off_t next, int plus)
+{
+    size_t entry_size;
+
+    if (plus)
+        entry_size = fuse_add_direntry_plus(req, buf + *used, size - *used, name, e, next);
+    else
+        entry_size = fuse_add_direntry(req, buf + *used, size - *used, name, &e->attr, next);
+    if (entry_size > size - *used)
+        return -1;
+
+    *used += entry_size;
+    return 0;
+}
+
+/* Lists the root directory from an offset, with the entries of the files when plus is set */
+static void read_directory(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, int plus)
+{
+    ll_fs *ll = get_ll(req);
+    struct fuse_entry_param e;
+    char file_name[MAXFILENAME];
+    char *buf;
+    size_t used = 0;
+    int position;
+    int inode;
+
+    if (ino != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    buf = malloc(size > 0 ? size : 1);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    memset(&e, 0, sizeof(struct fuse_entry_param)); // no inode for "." and "..", the kernel takes no reference
+    root_stat(&e.attr);
+    if ((offset >= 1 || add_entry(req, buf, size, &used, ".", &e, 1, plus) == 0)
+            && (offset >= 2 || add_entry(req, buf, size, &used, "..", &e, 2, plus) == 0)) {
+        position = offset > FIRST_FILE_OFFSET ? offset - FIRST_FILE_OFFSET : 0;
+        while ((inode = sfs_getnextdirent_r(ll->fs, &position, file_name)) != -1) {
+            if (plus) {
+                if (fill_entry(ll, inode, &e) == -1)
+                    continue; // removed since it was listed
+                ref_inode(ll, inode, 1, 0); // the kernel looks up every entry it is given
+            } else {
+                file_stat(ll, inode, 0, &e.attr);
+            }
+            if (add_entry(req, buf, size, &used, &file_name[1], &e, position + FIRST_FILE_OFFSET, plus) == -1) {
+                if (plus)
+                    forget_inode(ll, e.ino, 1);
+                break;
+            }
+        }
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    read_directory(req, ino, size, offset, 0);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    read_directory(req, ino, size, offset, 1);
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mknod = ll_mknod,
+    .unlink = ll_unlink,
+    .open = ll_open,
+    .create = ll_create,
+    .read = ll_read,
+    .write_buf = ll_write_buf,
+    .flush = ll_flush,
+    .release = ll_release,
+    .fsync = ll_fsync,
+    .readdir = ll_readdir,
+    .readdirplus = ll_readdirplus,
+};
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    sfs_options sfs_opts;
+    sfs_geometry geometry;
+    ll_fs ll;
+    int res = 1;
+
+    memset(&ll, 0, sizeof(ll_fs));
+    ll.entry_timeout = 1.0;
+    ll.attr_timeout = 1.0;
+    pthread_mutex_init(&ll.lock, NULL);
+
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        printf("    -o image=FILE          disk image (default: %s)\n"
+               "    -o fresh               format the image before mounting\n"
+               "    -o entry_timeout=T     seconds names are cached (default: 1.0)\n"
+               "    -o attr_timeout=T      seconds attributes are cached (default: 1.0)\n", DEFAULT_IMAGE);
+        res = 0;
+        goto out_args;
+    }
+    if (opts.show_version) {
+        fuse_lowlevel_version();
+        res = 0;
+        goto out_args;
+    }
+    if (opts.mountpoint == NULL) {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        goto out_args;
+    }
+    if (fuse_opt_parse(&args, &ll, ll_opts, NULL) == -1)
+        goto out_args;
+
+    sfs_default_options(&sfs_opts);
+    sfs_opts.fresh = ll.fresh;
+    ll.fs = sfs_mount(ll.image != NULL ? ll.image : DEFAULT_IMAGE, &sfs_opts);
+    if (ll.fs == NULL)
+        goto out_args;
+    sfs_get_geometry_r(ll.fs, &geometry);
+    ll.num_inodes = geometry.num_inodes;
+    ll.inodes = calloc(ll.num_inodes, sizeof(ll_inode));
+    if (ll.inodes == NULL)
+        goto out_sfs;
+
+    se = fuse_session_new(&args, &ll_oper, sizeof(ll_oper), &ll);
+    if (se == NULL)
+        goto out_sfs;
+    if (fuse_set_signal_handlers(se) != 0)
+        goto out_session;
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        goto out_signals;
+
+    fuse_daemonize(opts.foreground);
+    if (opts.singlethread)
+        res = fuse_session_loop(se);
+    else
+        res = fuse_session_loop_mt(se, opts.clone_fd);
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_session:
+    fuse_session_destroy(se);
+out_sfs:
+    free(ll.inodes);
+    sfs_unmount(ll.fs);
+out_args:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return res ? 1 : 0;
+}
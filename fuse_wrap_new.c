@@ -9,10 +9,13 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+#define MAX_WRITE (1024 * 1024) // libfuse lowers it to what its buffers hold
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -69,82 +72,104 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     int res;
     char filename[MAXFILENAME];
     
+    if (strlen(path) >= MAXFILENAME)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
     res = sfs_fopen(filename);
     if (res == -1)
-        return -errno;
+        return -ENOENT;
     
-    sfs_fclose(res);
+    fi->fh = res; // kept open until release, so reads and writes go straight to the fd
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
+    res = sfs_pread(fi->fh, buf, size, offset); // positional, so the threads serving one handle do not share a pointer
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_pwrite(fi->fh, buf, size, offset); // positional, so the threads serving one handle do not share a pointer
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
+static int fuse_flush(const char *path, struct fuse_file_info *fi)
+{
+    if (sfs_fflush(fi->fh) == -1)
+        return -EIO;
+
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    sfs_fclose(fi->fh);
+    return 0;
+}
+
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    if (size > INT_MAX)
+        return -EFBIG;
+    if (sfs_ftruncate(fi->fh, size) == -1) // in place, so other handles on the file stay valid
+        return -EIO;
+
+    return 0;
+}
+
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    struct fuse_file_info fi;
+    int res;
     
-    strcpy(filename, path);
+    if (sfs_getfilesize(path) == -1) // opening would create it
+        return -ENOENT;
     
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
+    memset(&fi, 0, sizeof(fi));
+    res = fuse_open(path, &fi);
+    if (res != 0)
+        return res;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
+    res = fuse_ftruncate(path, size, &fi);
+    fuse_release(path, &fi);
+    return res;
+}
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    if (sfs_fsync(fi->fh) == -1) // only the file, not every inode of the file system
+        return -EIO;
+
     return 0;
 }
 
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    conn->want |= FUSE_CAP_BIG_WRITES; // whole writes of up to max_write, not a page at a time
+    conn->max_write = MAX_WRITE;
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    sfs_sync(); // write back the block cache before the file system goes away
+}
+
 static int fuse_access(const char *path, int mask)
 {
     return 0;
@@ -160,10 +185,14 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     char filename[MAXFILENAME];
     int fd;
     
+    if (strlen(path) >= MAXFILENAME)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     fd = sfs_fopen(filename);
+    if (fd == -1)
+        return -ENOSPC;
     
-    sfs_fclose(fd);
+    fp->fh = fd; // closed by release, like a handle from open
     return 0;
 }
 
@@ -173,15 +202,22 @@ static struct fuse_operations xmp_oper = {
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .flush = fuse_flush,
+    .release = fuse_release,
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    if (mksfs(1) == -1)
+        return 1;
     return fuse_main(argc, argv, &xmp_oper, NULL);
 }
@@ -1,30 +1,117 @@
 #include "disk_emu.h"
+#include "sfs_api.h"
+#include "sfs_dir.h"
+#include "sfs_cache.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #define true 1
 #define false 0
-#define MAX_FILE_NAME_LENGTH 16
-#define BLOCK_SIZE 1024
-#define MAX_DIRECTORIES 20
-#define FD_TABLE_SIZE 20
-#define NUM_BLOCKS 1024 // 1 MB file system
-#define NUM_POINTERS 13
-
-void mksfs(int fresh);                             // creates the file system
-int sfs_getnextfilename(char *fname);              // get the name of the next file in directory
-int sfs_getfilesize(const char *path);             // get the size of the given file
-int sfs_fopen(char *name);                         // opens the given file
-int sfs_fclose(int fileID);                        // closes the given file
-int sfs_fwrite(int fileID, char *buf, int length); // write buf characters into disk
-int sfs_fread(int fileID, char *buf, int length);  // read characters from disk into buf
-int sfs_fseek(int fileId, int loc);                // seek to the location from beginning
-int sfs_remove(char *file);                        // removes a file from the filesystem
+#define MAX_FILE_NAME_LENGTH (MAXFILENAME - 1)
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 1024 // 1 MB file system
+#define DEFAULT_NUM_INODES 20
+// geometry of the file system fs in scope, taken from its super block
+#define BLOCK_SIZE (fs->sb.block_size)
+#define NUM_BLOCKS (fs->sb.file_system_size)
+#define MAX_DIRECTORIES (fs->sb.inode_table_l) // one root directory slot per inode
+#define FD_CHUNK 64              // file descriptors added each time the table grows
+#define MAX_OPEN_FILES (1 << 16) // most file descriptors open at once
+#define NUM_DIRECT_POINTERS 12
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int)) // entries of an index block
+#define MAX_INDIRECTION 3                                  // single, double and triple indirect blocks
+#define EXTENT_ROOT_INTS 13                                // room for the root of an extent tree in an inode
+#define INODE_SIZE 256                                     // bytes per inode on disk
+#define INLINE_DATA_SIZE (INODE_SIZE - 6 * (int)sizeof(int)) // bytes of file data an inode can hold itself
+#define INODE_INLINE 0x1                                   // the file data is stored in the inode
+#define INODE_UNLINKED 0x2                                 // the name is gone, the file lives until it is released
+#define BITS_PER_WORD 64
+#define BIT_MAP_WORDS ((NUM_BLOCKS + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define SFS_MAGIC 0xACBD0005
+#define SFS_VERSION 4 // bumped whenever the on disk format changes
+#define EXTENT_BUCKETS 32 // free extents of length [2^k, 2^(k+1)) are kept in bucket k
+#define DEFAULT_DATA_CACHE (4 * 1024 * 1024) // bytes of file data kept in the block cache
+#define DEFAULT_METADATA_CACHE (1024 * 1024) // bytes of index blocks and extent tree nodes kept in the block cache
+#define MIN_READAHEAD 4   // blocks read ahead once reads turn out sequential
+#define MAX_READAHEAD 256 // largest read-ahead window in blocks
+#define MAP_AHEAD 8       // read-ahead looks up the blocks of this many windows at once
+#define DIR_SHARD_BITS 4  // the name index is split into 2^DIR_SHARD_BITS parts, each with its own lock
+#define DIR_SHARDS (1 << DIR_SHARD_BITS)
+#define DEFAULT_DISK "fs.sfs" // image of the file system behind the calls that take no handle
+
+void sfs_default_options(sfs_options *opts);       // fills in the settings of a plain mount
+sfs_t *sfs_mount(char *path, const sfs_options *opts); // opens or creates the file system in an image
+int sfs_unmount(sfs_t *fs);                        // writes everything back and closes the file system
+int sfs_getnextfilename_r(sfs_t *fs, char *fname); // get the name of the next file in directory
+int sfs_getfilesize_r(sfs_t *fs, const char *path); // get the size of the given file
+int sfs_fopen_r(sfs_t *fs, char *name);            // opens the given file
+int sfs_fcreate_r(sfs_t *fs, char *name);          // creates and opens the given file, which must not exist
+int sfs_fclose_r(sfs_t *fs, int fileID);           // closes the given file
+int sfs_fwrite_r(sfs_t *fs, int fileID, const char *buf, int length); // write buf characters into disk
+int sfs_fread_r(sfs_t *fs, int fileID, char *buf, int length); // read characters from disk into buf
+int sfs_pwrite_r(sfs_t *fs, int fileID, const char *buf, int length, int loc); // write at a position, the pointer stays
+int sfs_pread_r(sfs_t *fs, int fileID, char *buf, int length, int loc);        // read from a position, the pointer stays
+int sfs_fseek_r(sfs_t *fs, int fileId, int loc);   // seek to the location from beginning
+int sfs_remove_r(sfs_t *fs, char *file);           // removes a file from the filesystem
+int sfs_unlink_r(sfs_t *fs, char *file);           // removes the name of a file, which lives on until released
+int sfs_iremove_r(sfs_t *fs, int inode);           // releases a file whose name was removed
+int sfs_lookup_r(sfs_t *fs, const char *name);      // get the inode number of the given file
+int sfs_getinodesize_r(sfs_t *fs, int inode);       // get the size of the file with the given inode
+int sfs_getnextdirent_r(sfs_t *fs, int *position, char *fname); // list the directory from a position
+int sfs_iopen_r(sfs_t *fs, int inode);              // opens the file with the given inode
+int sfs_fileno_r(sfs_t *fs, int fileID);            // get the inode number of an open file
+int sfs_ftruncate_r(sfs_t *fs, int fileID, int length); // sets the size of the given file
+void sfs_get_geometry_r(sfs_t *fs, sfs_geometry *geometry); // get the geometry of the file system
+int sfs_pread_extents_r(sfs_t *fs, int fileID, int length, int loc, sfs_extent_fn move, void *arg);  // read where the bytes lie
+int sfs_pwrite_extents_r(sfs_t *fs, int fileID, int length, int loc, sfs_extent_fn move, void *arg); // write in place in the image
+int sfs_fflush_r(sfs_t *fs, int fileID);           // writes the delayed blocks of a file
+int sfs_fsync_r(sfs_t *fs, int fileID);            // makes the writes to a file durable
+int sfs_sync_r(sfs_t *fs);                         // makes every write durable
+void sfs_set_sync_interval_r(sfs_t *fs, int seconds); // syncs periodically from the write path, 0 to disable
+int sfs_set_cache_budget_r(sfs_t *fs, long data_bytes, long metadata_bytes); // sizes the block cache
+void sfs_set_discard_r(sfs_t *fs, int enabled);    // punches holes in the image over freed blocks
 
 //------------------------------- Structs -------------------------------//
 
+typedef struct block_pointers
+{
+    int d_pointer[NUM_DIRECT_POINTERS]; // direct pointers
+    int in_pointer;                      // single indirect pointer
+    int double_in_pointer;               // double indirect pointer
+    int triple_in_pointer;               // triple indirect pointer
+} block_pointers;
+
+typedef struct file_extent
+{
+    int logical;  // first logical block of the file
+    int physical; // block it is stored in
+    int length;   // number of blocks
+} file_extent;
+
+typedef struct extent_child
+{
+    int logical; // first logical block below the child
+    int block;   // block holding the child node
+} extent_child;
+
+typedef struct extent_header
+{
+    int count; // entries in use
+    int depth; // 0 for a leaf of file_extents, otherwise a node of extent_childs
+} extent_header;
+
+typedef struct extent_root
+{
+    extent_header header;
+    int entries[EXTENT_ROOT_INTS]; // laid out like the entries of a node block
+} extent_root;
+
 typedef struct inode
 {
     int mode;
@@ -32,23 +119,45 @@ typedef struct inode
     int uid;
     int gid;
     int size;
-    int d_pointer[12]; // direct pointers
-    int in_pointer;    // single indirect pointer
+    int flags; // INODE_INLINE
+    union
+    {
+        block_pointers pointers;            // when the file system maps blocks with pointers
+        extent_root extents;                // when the file system maps blocks with extents
+        char inline_data[INLINE_DATA_SIZE]; // when the file is small enough to live in the inode
+    } map;
 } inode_s;
 
 typedef struct directory_entry
 {
-    char *filename;
-    inode_s inode;
+    char filename[MAX_FILE_NAME_LENGTH + 1];
+    int inode; // index in the inode table, -1 when the slot is free
 } dir_e;
 
+typedef struct region
+{
+    int start;  // first block
+    int length; // number of blocks
+} region;
+
+typedef struct on_disk_data_struct
+{
+    region super_block;
+    region inode_table;
+    region root_dir;
+    region bit_map;
+    region data_blocks;
+} on_disk;
+
 typedef struct super_block
 {
-    int magic_num;
+    unsigned int magic_num;
     int block_size;
-    int file_system_size;
-    int inode_table_l;
-    dir_e *root_dir;
+    int file_system_size; // in blocks
+    int inode_table_l;    // number of inodes
+    on_disk layout;       // every region before data_blocks is file system metadata
+    int version;          // SFS_VERSION of the format
+    int block_mapping;    // SFS_MAP_POINTERS or SFS_MAP_EXTENTS
 } super_block;
 
 typedef struct inode_table
@@ -57,6 +166,7 @@ typedef struct inode_table
     int earliest_available;
     int length;
     inode_s *inodes;
+    char *used; // one flag per slot, so taking a free slot never reads an inode being written
 } inode_t;
 
 typedef struct data_blocks
@@ -65,35 +175,112 @@ typedef struct data_blocks
 
 typedef struct free_bit_map
 {
-    int earliest_available;
-    int *map;
+    int earliest_available; // lowest word that may still have a free block
+    int free_blocks;        // number of 0 bits, kept in step with the map
+    uint64_t *map;          // one bit per block, 1 when in use
 } fbm;
 
-typedef struct on_disk_data_struct
+typedef struct free_extent
 {
-    super_block sb;
-    inode_t inode_table;
-    int data_blocks;
-    fbm bit_map;
-} on_disk;
+    int start;
+    int length;
+    int prev; // neighbours in the size bucket, or in the unused slot list
+    int next;
+} free_extent;
+
+typedef struct extent_index
+{
+    free_extent *extents;        // slot pool, a free run never needs more than NUM_BLOCKS / 2 + 1 slots
+    int unused;                  // head of the unused slot list
+    int buckets[EXTENT_BUCKETS]; // head of each size bucket
+    int *by_start;               // slot of the free extent starting at a block, -1 if none
+    int *by_end;                 // slot of the free extent ending at a block, -1 if none
+} extent_index;
 
 //---------------------------- Memory Structs ----------------------------//
 
+typedef struct open_inode
+{
+    inode_s *inode;   // the inode in the inode table, NULL once the file is removed
+    int uid;          // the unique identifier of the inode
+    int open_count;   // number of file descriptors on the inode
+    int *block_map;   // physical block of each logical block of the file, filled in on demand
+    int mapped;       // number of logical blocks in block_map
+    int map_capacity; // number of logical blocks block_map has room for
+    pthread_mutex_t lock; // guards the block map and the read-ahead state, which readers share
+} open_inode;
+
 typedef struct open_fdt_entry
 {
-    inode_s inode;
+    open_inode *file; // shared by every file descriptor on the same inode, NULL while free
     int offset;
     int fd;
+    int next_free;  // next free file descriptor while this one is free, -1 at the end of the list
+    int next_block; // logical block after the last one read, where a sequential read carries on
+    int readahead;  // read-ahead window in blocks, 0 while reads are not sequential
+    int prefetched; // logical block read-ahead has reached
 } fdt_entry;
 
 typedef struct open_fd_table
 {
-    int earliest_available;
-    fdt_entry *table;
+    fdt_entry *chunks[MAX_OPEN_FILES / FD_CHUNK]; // FD_CHUNK entries each, so an entry never moves when the table grows
+    int size;            // number of file descriptors the table has room for
+    int free_head;       // first free file descriptor, -1 when every one is in use
+    open_inode **inodes; // open inodes by unique identifier, NULL while not open
 } fd_table;
 
-fd_table open_fd_table;
-dir_e *dir_cache = NULL;
+typedef struct delayed_data
+{
+    char *data;   // contents of the blocks past the last allocated one, BLOCK_SIZE each
+    int blocks;   // number of blocks in data, 0 when nothing is delayed
+    int capacity; // number of blocks data has room for
+    int size;     // size of the file with the delayed bytes
+} delayed_data;
+
+// Everything known about one mounted file system. The handle of the API points at one, and every
+// helper that touches the file system takes the one it works on as fs.
+struct sfs
+{
+    disk_t *disk;       // device holding the image
+    block_cache *cache; // blocks of the image kept in memory, NULL while not mounted
+    super_block sb;     // block_size is 0 while not mounted
+    inode_t inode_table;
+    fbm bit_map;               // map of free data blocks
+    extent_index free_extents; // free runs of bit_map indexed by size
+    dir_e *dir_cache;
+    dir_hash name_index[DIR_SHARDS]; // file name to directory slot and inode, rebuilt at mount
+    fd_table open_fd_table;
+    delayed_data *delayed; // writes waiting for blocks, by inode
+    int delayed_length;    // number of inodes delayed has room for
+    long delayed_blocks;   // blocks held by every delayed write
+    long reserved_blocks;  // free blocks set aside for the index blocks of stores under way
+    char *metadata;        // in memory copy of the metadata regions, the mapping itself in mmap mode
+    int metadata_owned;    // whether metadata was allocated here rather than mapped
+    char *metadata_dirty;  // one flag per metadata block changed since it was last written back
+    int num_entries;
+    int dir_index;
+    char *empty_block;
+    int sync_interval;         // seconds between automatic syncs, 0 means only on sfs_fsync/sfs_sync
+    time_t last_sync;
+    long data_cache_bytes;     // budget of the data pool of the block cache
+    long metadata_cache_bytes; // budget of the metadata pool of the block cache
+    int discard_freed;         // whether freed blocks are handed back to the image file
+    int disk_mode;             // how the image is opened, a DISK_MODE_ constant
+
+    // Locks, taken in this order: a name shard, an inode, then any of the others. The allocator,
+    // directory, file descriptor and metadata locks never wait on an inode or on the disk.
+    pthread_rwlock_t name_locks[DIR_SHARDS]; // each shard of name_index and the files named in it
+    pthread_rwlock_t *inode_locks;           // one per inode, shared to read a file, exclusive to change it
+    int inode_lock_count;                    // number of locks in inode_locks
+    pthread_mutex_t alloc_lock;              // free blocks, free inodes and delayed blocks, recursive
+    pthread_mutex_t dir_lock;                // root directory slots and the listing position
+    pthread_mutex_t fd_lock;                 // the file descriptor table, its free list and open inodes
+    pthread_mutex_t metadata_lock;           // stores into the metadata blocks and their dirty flags
+    pthread_mutex_t metadata_flush_lock;     // one metadata write back at a time, so an older copy never lands last
+    pthread_mutex_t sync_lock;               // periodic sync timer
+
+    sfs_t *next_mounted; // next in the list of file systems written back at exit
+};
 
 //------------------------------- Globals -------------------------------//
 
@@ -103,31 +290,60 @@ const inode_s default_inode = {
     .uid = -1,
     .gid = 0,
     .size = 0,
-    .d_pointer = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    .in_pointer = -1};
+    .flags = 0,
+    .map = {.pointers = {
+                .d_pointer = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+                .in_pointer = -1,
+                .double_in_pointer = -1,
+                .triple_in_pointer = -1}}};
 
-const dir_e default_dir = {.filename = "", .inode = {.mode = 0, .link_cnt = 0, .uid = -1, .gid = 0, .size = 0, .d_pointer = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, .in_pointer = -1}};
+const dir_e default_dir = {.filename = "", .inode = -1};
 
-const fdt_entry default_fdt_entry = {.fd = -1, .offset = -1, .inode = {.mode = 0, .link_cnt = 0, .uid = -1, .gid = 0, .size = 0, .d_pointer = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, .in_pointer = -1}};
+const sfs_geometry default_geometry = {
+    .block_size = DEFAULT_BLOCK_SIZE,
+    .num_blocks = DEFAULT_NUM_BLOCKS,
+    .num_inodes = DEFAULT_NUM_INODES,
+    .block_mapping = SFS_MAP_POINTERS};
 
-inode_t inode_table;
-super_block sb;
-fbm bit_map; // map of free data blocks
-int num_entries = 0;
-int dir_index = 0;
-char empty_block[BLOCK_SIZE];
+const fdt_entry default_fdt_entry = {.file = NULL, .fd = -1, .offset = -1, .next_free = -1, .next_block = 0, .readahead = 0, .prefetched = 0};
+
+sfs_t *default_fs = NULL; // file system of the calls that take no handle
+pthread_once_t default_fs_once = PTHREAD_ONCE_INIT;
+sfs_t *mounted = NULL; // every mounted file system, linked through next_mounted
+pthread_mutex_t mounted_lock = PTHREAD_MUTEX_INITIALIZER;
+int flush_at_exit_registered = false;
 
 //------------------------------- Helpers -------------------------------//
 
 /**
  * Initializes the empty block with null characters.
  */
-void init_empty_block()
+void init_empty_block(sfs_t *fs)
+{
+    free(fs->empty_block);
+    fs->empty_block = calloc(BLOCK_SIZE, sizeof(char));
+}
+
+/**
+ * Sets up an empty block cache for the mounted disk within the configured budgets. The inode
+ * table, root directory and free bit map are kept in memory as a whole, so the metadata pool holds
+ * the blocks that map files: index blocks and extent tree nodes. A memory mapped disk gets no
+ * cache, its blocks are already reached through memory.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int init_block_cache(sfs_t *fs)
 {
-    for (int i = 0; i < BLOCK_SIZE; i++)
+    cache_free(fs->cache);
+    if (disk_map_block(fs->disk, 0) != NULL)
+    {
+        fs->cache = cache_init(fs->disk, BLOCK_SIZE, 0, 0);
+    }
+    else
     {
-        empty_block[i] = '\0';
+        fs->cache = cache_init(fs->disk, BLOCK_SIZE, fs->data_cache_bytes / BLOCK_SIZE, fs->metadata_cache_bytes / BLOCK_SIZE);
     }
+    return fs->cache == NULL ? -1 : 0;
 }
 
 /**
@@ -141,848 +357,4334 @@ void print(char *message)
 }
 
 /**
- * Initializes the free bit map.
+ * Creates a file system handle that is not mounted yet, with the default settings and the locks
+ * that outlive a mount.
+ *
+ * @param disk The device the file system is mounted from.
+ * @return The handle, or NULL if it could not be allocated.
  */
-void init_free_bit_map()
+sfs_t *new_context(disk_t *disk)
 {
-    bit_map.earliest_available = 0;
-    int map[BLOCK_SIZE] = {}; // will initialize values to 0
-    bit_map.map = map;
+    sfs_t *fs = calloc(1, sizeof(sfs_t));
+    if (fs == NULL)
+    {
+        return NULL;
+    }
+    fs->disk = disk;
+    fs->data_cache_bytes = DEFAULT_DATA_CACHE;
+    fs->metadata_cache_bytes = DEFAULT_METADATA_CACHE;
+    fs->disk_mode = DISK_MODE_PIO; // positional I/O, no shared seek pointer
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE); // allocations nest, e.g. index blocks inside a file write
+    pthread_mutex_init(&fs->alloc_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    for (int i = 0; i < DIR_SHARDS; i++)
+    {
+        pthread_rwlock_init(&fs->name_locks[i], NULL);
+    }
+    pthread_mutex_init(&fs->dir_lock, NULL);
+    pthread_mutex_init(&fs->fd_lock, NULL);
+    pthread_mutex_init(&fs->metadata_lock, NULL);
+    pthread_mutex_init(&fs->metadata_flush_lock, NULL);
+    pthread_mutex_init(&fs->sync_lock, NULL);
+    return fs;
 }
 
 /**
- * Calculates the number of available blocks in the file system.
+ * Frees a file system handle that is no longer mounted, along with its disk.
  *
- * @return The number of available blocks.
+ * @param fs The handle to free.
  */
-int get_blocks_available()
+void free_context(sfs_t *fs)
 {
-    int counter = 0;
-    for (int i = 0; i < BLOCK_SIZE; i++)
+    pthread_mutex_destroy(&fs->alloc_lock);
+    for (int i = 0; i < DIR_SHARDS; i++)
     {
-        if (bit_map.map[i] == 0)
-        {
-            counter++;
-        }
+        pthread_rwlock_destroy(&fs->name_locks[i]);
     }
-    return counter;
+    pthread_mutex_destroy(&fs->dir_lock);
+    pthread_mutex_destroy(&fs->fd_lock);
+    pthread_mutex_destroy(&fs->metadata_lock);
+    pthread_mutex_destroy(&fs->metadata_flush_lock);
+    pthread_mutex_destroy(&fs->sync_lock);
+    disk_free(fs->disk);
+    free(fs);
 }
 
 /**
- * Initializes the open file descriptor table.
+ * Creates the handle behind the calls that take none, on the default disk so the disk model
+ * calls of disk_emu still apply to it.
  */
-void init_open_fd_table()
+void init_default_context()
 {
-    fdt_entry *table = malloc(FD_TABLE_SIZE * sizeof(fdt_entry)); // will initialize values to 0
+    default_fs = new_context(get_default_disk());
+}
 
-    for (int i = 0; i < FD_TABLE_SIZE; i++)
-    {
-        table[i] = default_fdt_entry;
-    }
-    open_fd_table.table = table;
+/**
+ * Returns the handle behind the calls that take none, creating it on first use.
+ */
+sfs_t *default_context()
+{
+    pthread_once(&default_fs_once, init_default_context);
+    return default_fs;
 }
 
 /**
- * Initializes the super block of the file system.
+ * Frees the reader/writer lock of every inode of a file system.
+ *
+ * @param fs The file system.
  */
-void init_super_block()
+void free_inode_locks(sfs_t *fs)
 {
-    dir_e *dirs = malloc(MAX_DIRECTORIES * sizeof(dir_e));
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
+    for (int i = 0; i < fs->inode_lock_count; i++)
     {
-        dirs[i] = default_dir;
-    };
-    sb.magic_num = 0;
-    sb.block_size = BLOCK_SIZE;
-    sb.file_system_size = 0;
-    sb.inode_table_l = 0;
-    sb.root_dir = dirs;
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+    }
+    free(fs->inode_locks);
+    fs->inode_locks = NULL;
+    fs->inode_lock_count = 0;
 }
 
 /**
- * Initializes the directory cache with the root directory.
+ * Sets up one reader/writer lock per inode of the mounted file system. Nothing else may run on
+ * the file system meanwhile.
  */
-void init_dir_cache()
+void init_inode_locks(sfs_t *fs)
 {
-    dir_cache = sb.root_dir;
+    free_inode_locks(fs);
+    fs->inode_locks = malloc(MAX_DIRECTORIES * sizeof(pthread_rwlock_t));
+    for (int i = 0; i < MAX_DIRECTORIES; i++)
+    {
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    }
+    fs->inode_lock_count = MAX_DIRECTORIES;
 }
 
 /**
- * Adds a directory entry to the super block.
+ * Returns the shard of the name index a file name belongs to. Shards are picked with the top
+ * bits of the hash, the index itself places names with the bottom ones.
  *
- * @param entry The directory entry to be added.
+ * @param name The file name.
+ * @return The shard number.
  */
-void add_mapping_to_super_block(dir_e entry)
+int name_shard(const char *name)
 {
-    sb.root_dir[num_entries] = entry;
+    return dir_hash_name(name) >> (32 - DIR_SHARD_BITS);
 }
 
 /**
- * Removes a directory entry from the super block.
- *
- * @param entry The directory entry to be removed.
+ * Returns the number of blocks of the given size needed to hold the given number of bytes.
  */
-void remove_mapping_from_super_block(dir_e entry)
+long long blocks_for(long long bytes, int block_size)
 {
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
-    {
-        dir_e entry = sb.root_dir[i];
-        if (strcmp(entry.filename, entry.filename) == 0)
-        {
-            sb.root_dir[i] = default_dir;
-            break;
-        }
-    }
+    return bytes / block_size + (bytes % block_size != 0);
 }
 
 /**
- * Adds a directory entry to the super block dir_cache.
+ * Fills in a super block for the given geometry, with the metadata regions laid out back to back
+ * at the start of the disk.
  *
- * @param entry The directory entry to be added.
- * @return 1 if the directory entry was successfully added, -1 if the file system is full.
+ * @param super The super block to fill in.
+ * @param geometry Block size, number of blocks and number of inodes of the file system.
+ * @return 0 if successful, -1 if the geometry is invalid or leaves no room for data blocks.
  */
-int add_mapping(dir_e entry)
+int init_layout(super_block *super, const sfs_geometry *geometry)
 {
-    if (num_entries > MAX_DIRECTORIES)
+    if (geometry->block_size < (int)sizeof(super_block) || geometry->num_blocks <= 0 || geometry->num_inodes <= 0 ||
+        (geometry->block_mapping != SFS_MAP_POINTERS && geometry->block_mapping != SFS_MAP_EXTENTS))
     {
-        print("File system full.");
         return -1;
     }
-    add_mapping_to_super_block(entry);
-    if (dir_cache != NULL)
-    {
-        dir_cache = sb.root_dir; // instance of root_dir
+    int words = (geometry->num_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    long long inode_blocks = blocks_for((long long)geometry->num_inodes * sizeof(inode_s), geometry->block_size);
+    long long dir_blocks = blocks_for((long long)geometry->num_inodes * sizeof(dir_e), geometry->block_size);
+    long long bit_map_blocks = blocks_for((long long)words * sizeof(uint64_t), geometry->block_size);
+    long long metadata_blocks = 1 + inode_blocks + dir_blocks + bit_map_blocks;
+    if (metadata_blocks >= geometry->num_blocks || metadata_blocks * geometry->block_size > INT32_MAX)
+    { // the metadata has to fit on the disk and in memory with room to spare
+        return -1;
     }
-    num_entries += 1;
-    return 1;
+    on_disk *layout = &super->layout;
+    super->magic_num = SFS_MAGIC;
+    super->version = SFS_VERSION;
+    super->block_size = geometry->block_size;
+    super->file_system_size = geometry->num_blocks;
+    super->inode_table_l = geometry->num_inodes;
+    super->block_mapping = geometry->block_mapping;
+    layout->super_block.start = 0;
+    layout->super_block.length = 1;
+    layout->inode_table.start = layout->super_block.start + layout->super_block.length;
+    layout->inode_table.length = inode_blocks;
+    layout->root_dir.start = layout->inode_table.start + layout->inode_table.length;
+    layout->root_dir.length = dir_blocks;
+    layout->bit_map.start = layout->root_dir.start + layout->root_dir.length;
+    layout->bit_map.length = bit_map_blocks;
+    layout->data_blocks.start = layout->bit_map.start + layout->bit_map.length;
+    layout->data_blocks.length = geometry->num_blocks - layout->data_blocks.start;
+    return 0;
 }
 
 /**
- * Removes a directory entry from the super block and dir_cache.
- *
- * @param entry The directory entry to be removed.
- * @return 1 if the directory entry was successfully removed, -1 if the file system is empty.
+ * Sets up the in memory copy of the metadata regions and points the tables at it. In mmap mode the
+ * mapping is used directly, so the tables are read and updated in place.
  */
-int remove_mapping(dir_e entry)
+void attach_metadata(sfs_t *fs)
 {
-    if (num_entries == 0)
+    int blocks = fs->sb.layout.data_blocks.start;
+    free(fs->metadata_dirty);
+    fs->metadata_dirty = calloc(blocks, sizeof(char));
+    if (fs->metadata_owned)
     {
-        print("File system empty. Nothing to remove.");
-        return -1;
+        free(fs->metadata);
     }
-    remove_mapping_from_super_block(entry);
-    if (dir_cache != NULL)
+    fs->metadata = disk_map_block(fs->disk, 0);
+    fs->metadata_owned = fs->metadata == NULL;
+    if (fs->metadata_owned)
     {
-        dir_cache = sb.root_dir; // instance of root_dir
+        fs->metadata = calloc(blocks, BLOCK_SIZE);
     }
-    num_entries -= 1;
-    return 1;
+    fs->inode_table.inodes = (inode_s *)(fs->metadata + fs->sb.layout.inode_table.start * BLOCK_SIZE);
+    fs->dir_cache = (dir_e *)(fs->metadata + fs->sb.layout.root_dir.start * BLOCK_SIZE);
+    fs->bit_map.map = (uint64_t *)(fs->metadata + fs->sb.layout.bit_map.start * BLOCK_SIZE);
 }
 
 /**
- * Initializes the inode table.
+ * Updates part of the metadata and records that it has to be written back. The copy happens
+ * under the metadata lock so a concurrent flush never writes a half updated block.
+ *
+ * @param address Start of the change, inside the metadata regions.
+ * @param value The new bytes.
+ * @param length Number of bytes changed.
  */
-void init_inode_table()
+void store_metadata(sfs_t *fs, void *address, const void *value, size_t length)
 {
-    inode_table.earliest_available = 0;
-    inode_table.free_inodes = MAX_DIRECTORIES;
-    inode_table.length = 0;
-    inode_s inodes[MAX_DIRECTORIES] = {};
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
+    size_t offset = (const char *)address - fs->metadata;
+    pthread_mutex_lock(&fs->metadata_lock);
+    memcpy(address, value, length);
+    for (size_t b = offset / BLOCK_SIZE; b <= (offset + length - 1) / BLOCK_SIZE; b++)
     {
-        inodes[i] = default_inode;
+        fs->metadata_dirty[b] = 1;
     }
-    inode_table.inodes = inodes;
+    pthread_mutex_unlock(&fs->metadata_lock);
 }
 
 /**
- * Creates a new inode entry in the inode table.
+ * Writes the changed metadata blocks back to disk in a single vectored request. The blocks are
+ * copied under the metadata lock and written without it, so stores carry on during the write.
  *
- * @param new_node The new inode to be added.
- * @return 1 if the inode entry was successfully created, -1 if the inode table is full.
+ * @return 0 if successful, -1 otherwise.
  */
-int create_inode_entry(inode_s new_node)
+int flush_metadata(sfs_t *fs)
 {
-    if (inode_table.length == MAX_DIRECTORIES)
+    if (fs->metadata == disk_map_block(fs->disk, 0))
+    { // updates already went straight into the mapped image
+        return 0;
+    }
+    int blocks = fs->sb.layout.data_blocks.start;
+    block_vec *vec = malloc(blocks * sizeof(block_vec));
+    pthread_mutex_lock(&fs->metadata_flush_lock);
+    pthread_mutex_lock(&fs->metadata_lock);
+    int count = 0;
+    for (int b = 0; b < blocks; b++)
     {
-        print("Cannot add anymore inodes to the table");
-        return -1;
+        count += fs->metadata_dirty[b];
     }
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
+    char *copy = malloc((size_t)(count > 0 ? count : 1) * BLOCK_SIZE);
+    count = 0;
+    for (int b = 0; b < blocks; b++)
     {
-        if (inode_table.inodes[i].uid == -1)
-        { // if default then replace
-            inode_table.inodes[i] = new_node;
-            inode_table.free_inodes--;
-            inode_table.length++;
-            return 1;
+        if (fs->metadata_dirty[b])
+        {
+            vec[count].address = b;
+            vec[count].buffer = copy + (size_t)count * BLOCK_SIZE;
+            memcpy(vec[count].buffer, fs->metadata + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+            count++;
+            fs->metadata_dirty[b] = 0;
         }
     }
-    return -1;
+    pthread_mutex_unlock(&fs->metadata_lock);
+    int status = disk_writev_blocks(fs->disk, vec, count) == -1 ? -1 : 0;
+    if (status == -1)
+    { // written back with the next flush
+        pthread_mutex_lock(&fs->metadata_lock);
+        for (int i = 0; i < count; i++)
+        {
+            fs->metadata_dirty[vec[i].address] = 1;
+        }
+        pthread_mutex_unlock(&fs->metadata_lock);
+    }
+    pthread_mutex_unlock(&fs->metadata_flush_lock);
+    free(copy);
+    free(vec);
+    return status;
 }
 
 /**
- * Removes an inode from the inode table based on the given uid.
- *
- * @param uid The unique identifier of the inode to be removed.
- * @return The removed inode, or the default inode if no matching inode is found.
+ * Initializes the free bit map, reserving the blocks that hold the file system metadata.
  */
-inode_s remove_inode(int uid)
+void init_free_bit_map(sfs_t *fs)
 {
-    inode_s node;
-    if (inode_table.free_inodes == MAX_DIRECTORIES)
+    memset(fs->bit_map.map, 0, BIT_MAP_WORDS * sizeof(uint64_t)); // will initialize values to 0
+    if (NUM_BLOCKS % BITS_PER_WORD != 0)
+    { // bits past the last block are never handed out
+        fs->bit_map.map[BIT_MAP_WORDS - 1] = ~0ULL << (NUM_BLOCKS % BITS_PER_WORD);
+    }
+    for (int i = 0; i < fs->sb.layout.data_blocks.start; i++)
     {
-        print("No inodes to remove.");
-        return default_inode;
+        fs->bit_map.map[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
     }
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
+}
+
+/**
+ * Recomputes the free block count and search hint of a formatted or freshly loaded free bit map.
+ */
+void load_free_bit_map(sfs_t *fs)
+{
+    fs->bit_map.free_blocks = 0;
+    fs->bit_map.earliest_available = BIT_MAP_WORDS;
+    for (int w = BIT_MAP_WORDS - 1; w >= 0; w--)
     {
-        node = inode_table.inodes[i];
-        if (node.uid == uid)
+        fs->bit_map.free_blocks += BITS_PER_WORD - __builtin_popcountll(fs->bit_map.map[w]);
+        if (fs->bit_map.map[w] != ~0ULL)
         {
-            inode_table.inodes[i] = default_inode;
-            inode_table.length--;
-            inode_table.free_inodes++;
-            return node;
+            fs->bit_map.earliest_available = w;
         }
     }
-    return default_inode;
 }
 
 /**
- * Initializes a new inode with default values and assigns a unique identifier.
+ * Writes an empty file system to a fresh disk: the super block, an inode table and a root
+ * directory with every slot free, and a free bit map with only the metadata blocks in use.
  *
- * @return The initialized inode.
+ * @param super Super block describing the geometry and layout of the new file system.
  */
-inode_s init_inode()
+void format_metadata(sfs_t *fs, const super_block *super)
 {
-    if (inode_table.free_inodes == 0)
+    fs->sb = *super;
+    attach_metadata(fs);
+    memcpy(fs->metadata, &fs->sb, sizeof(super_block));
+    for (int i = 0; i < MAX_DIRECTORIES; i++)
     {
-        print("No remaining space in file system.");
-        return default_inode;
+        fs->inode_table.inodes[i] = default_inode;
+        fs->dir_cache[i] = default_dir;
     }
-    inode_s new_node = default_inode;
-    new_node.uid = inode_table.length;
-    inode_table.length++;
-    return new_node;
+    init_free_bit_map(fs);
+    memset(fs->metadata_dirty, 1, fs->sb.layout.data_blocks.start);
+    flush_metadata(fs);
 }
 
 /**
- * Retrieves a directory entry based on the given filename.
+ * Checks whether an image holds nothing yet, so a file system can be created in it without
+ * losing anything.
  *
- * @param filename The name of the file to retrieve the directory entry for.
- * @return The directory entry matching the filename, or the default directory entry if no matching entry is found.
+ * @param path The disk image.
+ * @return 1 if the image does not exist or is empty, 0 otherwise.
  */
-dir_e get_dir_entry(char *filename)
+int image_is_blank(char *path)
 {
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
-    {
-        dir_e entry = dir_cache[i];
-        if (entry.filename == filename)
-        {
-            return entry;
-        }
-    }
-    return default_dir;
+    struct stat st;
+    return stat(path, &st) == -1 ? errno == ENOENT : st.st_size == 0;
 }
 
 /**
- * Updates a directory entry with the given inode.
+ * Opens an existing file system. The super block is read first on its own, since the geometry it
+ * records decides how the disk is opened, then the inode table, root directory and free bit map
+ * are loaded with one sequential read.
  *
- * @param node The inode to update the directory entry with.
- * @return 1 if the update was successful, 0 otherwise.
+ * @param filename The disk image to open.
+ * @return 0 if the disk holds a valid file system, -1 otherwise.
  */
-int update_dir_entry(inode_s node)
+int mount_disk(sfs_t *fs, char *filename)
 {
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
+    super_block disk_sb;
+    super_block expected;
+    if (disk_init(fs->disk, filename, sizeof(super_block), 1, DISK_MODE_PIO) == -1 || disk_read_blocks(fs->disk, 0, 1, &disk_sb) == -1)
     {
-        dir_e entry = dir_cache[i];
-        if (entry.inode.uid == node.uid)
-        {
-            entry.inode = node;
-            dir_cache[i] = entry;
-            return 1;
-        }
+        disk_close(fs->disk);
+        print("Unable to read the super block of the disk.");
+        return -1;
+    }
+    disk_close(fs->disk);
+    sfs_geometry geometry = {
+        .block_size = disk_sb.block_size,
+        .num_blocks = disk_sb.file_system_size,
+        .num_inodes = disk_sb.inode_table_l,
+        .block_mapping = disk_sb.block_mapping};
+    if (disk_sb.magic_num != SFS_MAGIC)
+    {
+        print("No file system found on disk.");
+        return -1;
+    }
+    if (disk_sb.version != SFS_VERSION)
+    { // an image of another format is left alone rather than reformatted
+        print("Unsupported file system version on disk.");
+        return -1;
+    }
+    if (init_layout(&expected, &geometry) == -1 || memcmp(&disk_sb.layout, &expected.layout, sizeof(on_disk)) != 0)
+    {
+        print("Corrupt super block on disk.");
+        return -1;
+    }
+    if (disk_init(fs->disk, filename, geometry.block_size, geometry.num_blocks, fs->disk_mode) == -1)
+    {
+        return -1;
+    }
+    fs->sb = disk_sb;
+    attach_metadata(fs);
+    if (fs->metadata != disk_map_block(fs->disk, 0) && disk_read_blocks(fs->disk, 0, fs->sb.layout.data_blocks.start, fs->metadata) == -1)
+    {
+        return -1;
     }
     return 0;
 }
 
 /**
- * Retrieves the index of the inode with the given UID.
- * @param uid The unique identifier of the inode to retrieve the index for.
- * @return The index of the inode with the given UID, or -1 if no matching inode is found.
+ * Calculates the number of available blocks in the file system, leaving out the blocks set aside
+ * for index blocks.
+ *
+ * @return The number of available blocks.
  */
-int get_inode_index(int uid)
+int get_blocks_available(sfs_t *fs)
 {
-    for (int i = 0; i < inode_table.length; i++)
-    {
-        inode_s curr = inode_table.inodes[i];
-        if (curr.uid == uid)
-        {
-            return i;
-        }
-    }
-    return -1;
+    return fs->bit_map.free_blocks - fs->reserved_blocks;
 }
 
 /**
- * Retrieves the inode with the given UID.
+ * Finds the next run of free blocks, skipping a whole word at a time while it is full or empty.
  *
- * @param uid The unique identifier of the inode to retrieve.
- * @return The inode with the given UID, or the default inode if no matching inode is found.
+ * @param from The block to start searching at.
+ * @param length A pointer to an integer where the length of the run will be stored.
+ * @return The first block of the run, or -1 if there are no free blocks past from.
  */
-inode_s get_inode(int uid)
+int find_free_run(sfs_t *fs, int from, int *length)
 {
-    int index;
-    if ((index = get_inode_index(uid)) != -1)
+    int start = -1;
+    if (from < fs->bit_map.earliest_available * BITS_PER_WORD)
+    { // every word before earliest_available is full
+        from = fs->bit_map.earliest_available * BITS_PER_WORD;
+    }
+    for (int w = from / BITS_PER_WORD; w < BIT_MAP_WORDS; w++)
     {
-        return inode_table.inodes[index];
+        uint64_t used = fs->bit_map.map[w];
+        if (w == from / BITS_PER_WORD)
+        { // ignore blocks before from
+            used |= (1ULL << (from % BITS_PER_WORD)) - 1;
+        }
+        if (start == -1)
+        {
+            if (used == ~0ULL)
+            {
+                continue;
+            }
+            start = w * BITS_PER_WORD + __builtin_ctzll(~used);
+            used &= ~((1ULL << (start % BITS_PER_WORD)) - 1); // the run ends at the next used bit after start
+        }
+        if (used != 0)
+        {
+            int end = w * BITS_PER_WORD + __builtin_ctzll(used);
+            *length = end - start;
+            return start;
+        }
     }
-    else
+    if (start != -1)
     {
-        return default_inode;
+        *length = NUM_BLOCKS - start;
     }
+    return start;
 }
 
 /**
- * Checks if a file with the given name exists in the directory cache.
+ * Marks a block as in use in the free bit map.
  *
- * @param name The name of the file to check for existence.
- * @return 1 if the file exists, 0 if it does not.
+ * @param block The block to mark.
  */
-int does_file_exist(char *name)
+void mark_block_used(sfs_t *fs, int block)
 {
-    if (dir_cache == NULL)
+    uint64_t bit = 1ULL << (block % BITS_PER_WORD);
+    if (!(fs->bit_map.map[block / BITS_PER_WORD] & bit))
     {
-        print("Directory cache not initialized. Please set.");
-        return -1;
+        uint64_t word = fs->bit_map.map[block / BITS_PER_WORD] | bit;
+        store_metadata(fs, &fs->bit_map.map[block / BITS_PER_WORD], &word, sizeof(uint64_t));
+        fs->bit_map.free_blocks--;
     }
-    for (int i = 0; i < MAX_DIRECTORIES; i++)
+    while (fs->bit_map.earliest_available < BIT_MAP_WORDS && fs->bit_map.map[fs->bit_map.earliest_available] == ~0ULL)
     {
-        if (strcmp(dir_cache[i].filename, name) == 0)
-        {
-            return true;
-        }
+        fs->bit_map.earliest_available++;
     }
-    return false;
 }
 
 /**
- * Creates a directory entry for a file and inode.
+ * Marks a block as free in the free bit map.
  *
- * @param name The name of the file to be created.
- * @param new_node The inode of the new file.
- * @return 1 if the file is successfully created, -1 if the file already exists, or the file name is too long.
+ * @param block The block to mark.
+ * @return 1 if the block was in use, 0 if it was already free.
  */
-int create_file(char *name, inode_s new_node)
+int mark_block_free(sfs_t *fs, int block)
 {
-    if (does_file_exist(name))
+    uint64_t bit = 1ULL << (block % BITS_PER_WORD);
+    if (!(fs->bit_map.map[block / BITS_PER_WORD] & bit))
     {
-        print("File with same name already exists");
-        return 1;
+        return 0;
     }
-
-    if (strlen(name) > MAX_FILE_NAME_LENGTH)
+    uint64_t word = fs->bit_map.map[block / BITS_PER_WORD] & ~bit;
+    store_metadata(fs, &fs->bit_map.map[block / BITS_PER_WORD], &word, sizeof(uint64_t));
+    fs->bit_map.free_blocks++;
+    if (block / BITS_PER_WORD < fs->bit_map.earliest_available)
     {
-        print("File name too long");
-        return -1;
+        fs->bit_map.earliest_available = block / BITS_PER_WORD;
     }
-
-    dir_e inode_dir;
-    inode_dir.filename = name;
-    inode_dir.inode = new_node;
-    // update root directory in super block and directory cache
-    add_mapping(inode_dir);
     return 1;
 }
 
 /**
- * Checks if a file descriptor exists in the open file descriptor table.
- *
- * @param fd The file descriptor to check for existence.
- * @return The unique identifier of the inode if the file descriptor exists, or 0 if it does not.
+ * Returns the size bucket of a free extent of the given length.
  */
-int does_fd_exist(int fd)
+int extent_bucket(int length)
 {
-    for (int i = 0; i < FD_TABLE_SIZE; i++)
-    {
-        if (open_fd_table.table[i].fd == fd)
-        {
-            return open_fd_table.table[i].inode.uid;
-        }
-    }
-    return false;
+    return 31 - __builtin_clz(length);
 }
 
 /**
- * Retrieves the file descriptor table entry for the given file descriptor.
- *
- * @param fd The file descriptor to retrieve the entry for.
- * @return The file descriptor table entry for the given file descriptor.
+ * Adds the extent in the given slot to its size bucket and to the start and end indexes.
  */
-fdt_entry get_fd_entry(int fd)
+void link_extent(sfs_t *fs, int slot)
 {
-    for (int i = 0; i < FD_TABLE_SIZE; i++)
+    free_extent *e = &fs->free_extents.extents[slot];
+    int bucket = extent_bucket(e->length);
+    e->prev = -1;
+    e->next = fs->free_extents.buckets[bucket];
+    if (e->next != -1)
     {
-        if (open_fd_table.table[i].fd == fd)
-        {
-            return open_fd_table.table[i];
-        }
+        fs->free_extents.extents[e->next].prev = slot;
     }
-    return default_fdt_entry;
+    fs->free_extents.buckets[bucket] = slot;
+    fs->free_extents.by_start[e->start] = slot;
+    fs->free_extents.by_end[e->start + e->length - 1] = slot;
 }
 
 /**
- * Updates the file descriptor table entry with the given entry.
- *
- * @param entry The file descriptor table entry to update.
- * @return 1 if the entry is successfully updated, 0 if the entry does not exist in the table.
+ * Removes the extent in the given slot from its size bucket and from the start and end indexes.
  */
-int update_fd_entry(fdt_entry entry)
+void unlink_extent(sfs_t *fs, int slot)
 {
-    for (int i = 0; i < FD_TABLE_SIZE; i++)
+    free_extent *e = &fs->free_extents.extents[slot];
+    if (e->prev != -1)
     {
-        if (open_fd_table.table[i].fd == entry.fd)
-        {
-            open_fd_table.table[i] = entry;
-            return 1;
-        }
+        fs->free_extents.extents[e->prev].next = e->next;
     }
-    return 0;
+    else
+    {
+        fs->free_extents.buckets[extent_bucket(e->length)] = e->next;
+    }
+    if (e->next != -1)
+    {
+        fs->free_extents.extents[e->next].prev = e->prev;
+    }
+    fs->free_extents.by_start[e->start] = -1;
+    fs->free_extents.by_end[e->start + e->length - 1] = -1;
+}
+
+/**
+ * Returns an unlinked extent slot to the unused list.
+ */
+void release_extent_slot(sfs_t *fs, int slot)
+{
+    fs->free_extents.extents[slot].next = fs->free_extents.unused;
+    fs->free_extents.unused = slot;
 }
 
 /**
- * Creates a new file descriptor table entry for the given inode.
+ * Records a run of blocks as free, merging it with the free extents directly before and after it.
  *
- * @param node The inode for which to create the file descriptor table entry.
- * @return The file descriptor for the newly created entry, or -1 if the maximum number of open file descriptors has been reached.
+ * @param start First block of the run.
+ * @param length Number of blocks in the run.
  */
-int create_fd_entry(inode_s node)
+void insert_free_extent(sfs_t *fs, int start, int length)
 {
-    if (open_fd_table.earliest_available > FD_TABLE_SIZE)
+    int before = start > 0 ? fs->free_extents.by_end[start - 1] : -1;
+    int after = start + length < NUM_BLOCKS ? fs->free_extents.by_start[start + length] : -1;
+    if (before != -1)
     {
-        print("Max number of open file descriptors reached. Please close one in order to continue.");
-        return -1;
+        unlink_extent(fs, before);
+        start = fs->free_extents.extents[before].start;
+        length += fs->free_extents.extents[before].length;
+        release_extent_slot(fs, before);
     }
-    fdt_entry new_entry;
-    new_entry.fd = open_fd_table.earliest_available;
-    new_entry.offset = 0; // file descriptor to end of the file
-    new_entry.inode = node;
-    open_fd_table.table[open_fd_table.earliest_available] = new_entry;
-    for (int i = 0; i < FD_TABLE_SIZE; i++)
+    if (after != -1)
     {
-        if (open_fd_table.table[i].fd == -1)
-        {
-            open_fd_table.earliest_available = i;
-            break;
-        }
+        unlink_extent(fs, after);
+        length += fs->free_extents.extents[after].length;
+        release_extent_slot(fs, after);
     }
-    return new_entry.fd;
+    int slot = fs->free_extents.unused;
+    fs->free_extents.unused = fs->free_extents.extents[slot].next;
+    fs->free_extents.extents[slot].start = start;
+    fs->free_extents.extents[slot].length = length;
+    link_extent(fs, slot);
 }
 
 /**
- * Deletes a file descriptor table entry for the given file descriptor.
+ * Takes blocks from the front of a free extent, keeping whatever is left indexed.
  *
- * @param fd The file descriptor to delete.
- * @return 0 if the entry is successfully deleted, -1 if the entry does not exist in the table.
+ * @param slot Slot of the extent to take from.
+ * @param length Number of blocks to take, at most the length of the extent.
+ * @return The first block taken.
  */
-int delete_fd_entry(int fd)
+int take_from_extent(sfs_t *fs, int slot, int length)
 {
-    for (int i = 0; i < FD_TABLE_SIZE; i++)
+    free_extent *e = &fs->free_extents.extents[slot];
+    int start = e->start;
+    unlink_extent(fs, slot);
+    if (e->length > length)
     {
-        fdt_entry entry = open_fd_table.table[i];
-        if (entry.fd == fd)
-        {
-            if (open_fd_table.earliest_available > i)
-            {
-                open_fd_table.earliest_available = i;
-            }
-            open_fd_table.table[i] = default_fdt_entry;
-            return 0;
-        }
+        e->start += length;
+        e->length -= length;
+        link_extent(fs, slot);
     }
-    print("File descriptor for node does not exist.");
-    return -1;
+    else
+    {
+        release_extent_slot(fs, slot);
+    }
+    for (int i = start; i < start + length; i++)
+    {
+        mark_block_used(fs, i);
+    }
+    return start;
 }
 
 /**
- * Allocates blocks on disk for a file based on the given number of bytes.
- *
- * @param bytes The number of bytes for which to allocate blocks.
- * @param blocks_written A pointer to an integer where the number of blocks written will be stored.
- * @return An array of integers representing the allocated blocks, or NULL if allocation is not possible.
+ * Builds the free extent index from the free bit map.
  */
-int *allocate_blocks(int bytes, int *blocks_written)
+void init_free_extents(sfs_t *fs)
 {
-    int blocks_needed = bytes / BLOCK_SIZE + (bytes % BLOCK_SIZE != 0); // round up in case of imperfect division
-    if (blocks_needed > NUM_POINTERS)
+    int slots = NUM_BLOCKS / 2 + 1;
+    free(fs->free_extents.extents);
+    free(fs->free_extents.by_start);
+    free(fs->free_extents.by_end);
+    fs->free_extents.extents = malloc(slots * sizeof(free_extent));
+    for (int i = 0; i < slots; i++)
     {
-        print("Blocks needed > 13");
-        return NULL;
+        fs->free_extents.extents[i].next = i + 1 < slots ? i + 1 : -1;
     }
-    int blocks_available = get_blocks_available();
-    if (blocks_needed > blocks_available)
+    fs->free_extents.unused = 0;
+    for (int i = 0; i < EXTENT_BUCKETS; i++)
     {
-        print("Do not have enough blocks left to support allocation.");
-        return NULL;
+        fs->free_extents.buckets[i] = -1;
     }
-    int *blocks_allocated = (int *)malloc(blocks_needed);
-    int counter = 0;
-    for (int i = 0; i < BLOCK_SIZE && counter != blocks_needed; i++)
+    fs->free_extents.by_start = malloc(NUM_BLOCKS * sizeof(int));
+    fs->free_extents.by_end = malloc(NUM_BLOCKS * sizeof(int));
+    memset(fs->free_extents.by_start, -1, NUM_BLOCKS * sizeof(int));
+    memset(fs->free_extents.by_end, -1, NUM_BLOCKS * sizeof(int));
+
+    int length;
+    for (int start = find_free_run(fs, 0, &length); start != -1; start = find_free_run(fs, start + length, &length))
     {
-        if (bit_map.map[i] == 0)
-        {
-            blocks_allocated[counter] = i;
-            counter++;
-            bit_map.map[i] = 1;
-        }
+        insert_free_extent(fs, start, length);
     }
-    *blocks_written = blocks_needed;
-    return blocks_allocated;
 }
 
 /**
- * Counts the number of blocks allocated to the given inode.
+ * Allocates one contiguous run of at most the given number of blocks. A run starting at the goal
+ * block is preferred so files keep growing in place, then the smallest extent that fits the whole
+ * request, and otherwise the largest extent there is so the request needs as few runs as possible.
  *
- * @param node The inode for which to count the number of blocks.
- * @return The number of blocks allocated to the inode.
+ * @param goal Block the run should ideally start at, or -1 for no preference.
+ * @param wanted Number of blocks wanted.
+ * @param length A pointer to an integer where the number of blocks allocated will be stored.
+ * @return The first block of the run, or -1 if the disk is full.
  */
-int count_num_blocks(inode_s node)
+int allocate_extent(sfs_t *fs, int goal, int wanted, int *length)
 {
-    int counter = 0;
-    for (int i = 0; i < NUM_POINTERS; i++)
+    pthread_mutex_lock(&fs->alloc_lock);
+    int slot = goal >= 0 && goal < NUM_BLOCKS ? fs->free_extents.by_start[goal] : -1;
+    for (int bucket = extent_bucket(wanted); slot == -1 && bucket < EXTENT_BUCKETS; bucket++)
     {
-        if (i == NUM_POINTERS - 1)
+        for (int i = fs->free_extents.buckets[bucket]; i != -1; i = fs->free_extents.extents[i].next)
         {
-            if (node.in_pointer != -1)
+            int len = fs->free_extents.extents[i].length;
+            if (len >= wanted && (slot == -1 || len < fs->free_extents.extents[slot].length))
             {
-                counter++;
+                slot = i;
+            }
+            if (slot != -1 && bucket != extent_bucket(wanted))
+            { // everything in a higher bucket fits, no need for the best one
                 break;
             }
         }
-        if (node.d_pointer[i] != -1)
+    }
+    for (int bucket = EXTENT_BUCKETS - 1; slot == -1 && bucket >= 0; bucket--)
+    {
+        for (int i = fs->free_extents.buckets[bucket]; i != -1; i = fs->free_extents.extents[i].next)
         {
-            counter++;
+            if (slot == -1 || fs->free_extents.extents[i].length > fs->free_extents.extents[slot].length)
+            {
+                slot = i;
+            }
         }
     }
-    return counter;
-}
+    int start = -1;
+    if (slot != -1)
+    {
+        *length = fs->free_extents.extents[slot].length < wanted ? fs->free_extents.extents[slot].length : wanted;
+        start = take_from_extent(fs, slot, *length);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return start;
+}
 
 /**
- * Retrieves the blocks allocated to the given inode.
+ * Releases the blocks provided. Only the free bit map changes: freed blocks keep whatever they
+ * held, since every block is written in full when it is allocated again, whether with file data,
+ * zeros for a gap, or a fresh index block or extent tree node. Their cached copies are dropped
+ * so they are never written back, and with discarding on the image gets a hole punched over
+ * each run of them.
  *
- * @param node The inode for which to retrieve the allocated blocks.
- * @param num_blocks A pointer to an integer where the number of allocated blocks will be stored.
- * @return An array of integers representing the allocated blocks.
+ * @param blocks Blocks to be released.
+ * @param size Number of blocks to be released.
+ * @return 1 if release of blocks is successful or -1 otherwise
  */
-int *get_blocks(inode_s node, int *num_blocks)
+int release_blocks(sfs_t *fs, int *blocks, int size)
 {
-    int counter = count_num_blocks(node);
-    int *blocks_allocated = (int *)malloc(counter * sizeof(int));
-    for (int i = 0; i < NUM_POINTERS && i != counter; i++)
+    for (int i = 0; i < size; i++)
     {
-        if (i == NUM_POINTERS - 1)
+        if (blocks[i] < 0)
         {
-            if (node.in_pointer != -1)
-            {
-                blocks_allocated[i] = node.in_pointer;
-                break;
-            }
+            print("Unexpected block");
+            return -1;
         }
-
-        if (node.d_pointer[i] != -1)
+        cache_discard(fs->cache, blocks[i]);
+    }
+    for (int i = 0, run = 1; fs->discard_freed && i < size; i += run)
+    { // one hole per run of adjacent blocks, punched before another file can be given them
+        for (run = 1; i + run < size && blocks[i + run] == blocks[i] + run; run++)
         {
-            blocks_allocated[i] = node.d_pointer[i];
         }
+        disk_discard_blocks(fs->disk, blocks[i], run);
     }
-    *num_blocks = counter;
-    return blocks_allocated;
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int i = 0; i < size; i++)
+    {
+        if (mark_block_free(fs, blocks[i]))
+        {
+            insert_free_extent(fs, blocks[i], 1);
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return 1;
 }
 
 /**
- * Releases the blocks provided.
- *
- * @param blocks Blocks to be released.
- * @param size Number of blocks to be released.
- * @return 1 if release of blocks is successful or -1 otherwise
+ * Closes every file descriptor of the open file descriptor table and frees the table.
  */
-int release_blocks(int *blocks, int size)
+void free_open_fd_table(sfs_t *fs)
 {
-    for (int i = 0; i < size; i++)
+    for (int i = 0; i < fs->open_fd_table.size; i++)
     {
-        int block = blocks[i];
-        if (block < 0)
+        open_inode *file = fs->open_fd_table.chunks[i / FD_CHUNK][i % FD_CHUNK].file;
+        if (file != NULL && --file->open_count == 0)
         {
-            print("Unexpected block");
-            return -1;
+            pthread_mutex_destroy(&file->lock);
+            free(file->block_map);
+            free(file);
         }
-        bit_map.map[blocks[i]] = 0;
-
-        write_blocks(block, 1, empty_block);
     }
-    return 1;
+    for (int i = 0; i < fs->open_fd_table.size / FD_CHUNK; i++)
+    {
+        free(fs->open_fd_table.chunks[i]);
+        fs->open_fd_table.chunks[i] = NULL;
+    }
+    free(fs->open_fd_table.inodes);
+    fs->open_fd_table.inodes = NULL;
+    fs->open_fd_table.size = 0;
+    fs->open_fd_table.free_head = -1;
 }
 
-//------------------------------- Api Methods -------------------------------//
+/**
+ * Initializes the open file descriptor table, closing every file descriptor still in it.
+ */
+void init_open_fd_table(sfs_t *fs)
+{
+    free_open_fd_table(fs);
+    fs->open_fd_table.inodes = calloc(MAX_DIRECTORIES, sizeof(open_inode *));
+}
 
 /**
- * Creates and initializes the Small File System.
- *
- * @param fresh Determing if new file system or open existing
+ * Drops the delayed writes of every inode.
  */
-void mksfs(int fresh)
+void free_delayed_writes(sfs_t *fs)
 {
-    srand((unsigned int)(time(0))); // random number generator
-    if (!fresh)
-    { // load from storage
-        init_disk("fs.sfs", BLOCK_SIZE, NUM_BLOCKS);
-    }
-    else
+    for (int i = 0; i < fs->delayed_length; i++)
     {
-        init_fresh_disk("fs.sfs", BLOCK_SIZE, NUM_BLOCKS);
+        free(fs->delayed[i].data);
     }
-    init_empty_block();
-    init_free_bit_map();
-    init_inode_table();
-    init_open_fd_table();
-    init_super_block();
-    init_dir_cache();
+    free(fs->delayed);
+    fs->delayed = NULL;
+    fs->delayed_length = 0;
+    fs->delayed_blocks = 0;
 }
 
 /**
- * Reads the next file to the fname input variable.
- *
- * @param fname Variable to read to.
- * @return -1 if not more files 1 otherwise
+ * Initializes the delayed writes of every inode, dropping those of a previous mount.
  */
-int sfs_getnextfilename(char *fname)
+void init_delayed_writes(sfs_t *fs)
+{
+    free_delayed_writes(fs);
+    fs->delayed = calloc(MAX_DIRECTORIES, sizeof(delayed_data));
+    fs->delayed_length = MAX_DIRECTORIES;
+}
+
+/**
+ * Initializes the directory cache with the root directory.
+ */
+void init_dir_cache(sfs_t *fs)
 {
-    if (dir_index == -1)
+    fs->num_entries = 0;
+    fs->dir_index = 0;
+    for (int i = 0; i < DIR_SHARDS; i++)
     {
-        print("No more files in directory.");
-        return -1;
+        dir_hash_free(&fs->name_index[i]);
+        dir_hash_init(&fs->name_index[i], MAX_DIRECTORIES / DIR_SHARDS);
     }
-    strcpy(fname, dir_cache[dir_index].filename);
-    for (int i = dir_index + 1; i < MAX_DIRECTORIES; i++)
+    for (int i = 0; i < MAX_DIRECTORIES; i++)
     {
-        dir_e entry = dir_cache[i];
-        if (entry.inode.uid != -1)
+        if (fs->dir_cache[i].inode != -1)
         {
-            dir_index = i;
-            return 1;
+            dir_hash_insert(&fs->name_index[name_shard(fs->dir_cache[i].filename)], fs->dir_cache[i].filename, i, fs->dir_cache[i].inode);
+            fs->num_entries++;
         }
     }
-    dir_index = -1; // if gets to here no more entries
-    return 0;
 }
 
 /**
- * Retrieves the size of a file in the system if it exists.
+ * Adds a directory entry to the first free slot of the root directory. The caller holds the
+ * directory lock and the lock of the shard the name is in.
  *
- * @param path Path of the file
- * @return Length of the file if found -1 otherwise
+ * @param entry The directory entry to be added.
  */
-int sfs_getfilesize(const char *path)
+void add_mapping_to_root_dir(sfs_t *fs, dir_e entry)
 {
     for (int i = 0; i < MAX_DIRECTORIES; i++)
     {
-        dir_e entry = dir_cache[i];
-        if (strcmp(path, entry.filename) == 0)
+        if (fs->dir_cache[i].inode == -1)
         {
-            return entry.inode.size;
+            store_metadata(fs, &fs->dir_cache[i], &entry, sizeof(dir_e));
+            dir_hash_insert(&fs->name_index[name_shard(entry.filename)], fs->dir_cache[i].filename, i, entry.inode);
+            break;
         }
     }
-    print("File not found");
-    return -1;
 }
 
 /**
- * Creates the file in the file system and "opens" it by setting its read and write pointer.
+ * Removes a directory entry from the root directory. The caller holds the directory lock and
+ * the lock of the shard the name is in.
  *
- * @param name Name of the file to create
- * @return The file descriptor of the file created or -1 if unsuccessful
+ * @param entry The directory entry to be removed.
  */
-int sfs_fopen(char *name)
+void remove_mapping_from_root_dir(sfs_t *fs, dir_e entry)
 {
-    int fd;
-    inode_s new_node = init_inode();
-    if (new_node.uid == -1)
-    { // default inode
-        print("Probleming initializing inode.");
-        return -1;
+    dir_hash *shard = &fs->name_index[name_shard(entry.filename)];
+    dir_hash_entry *indexed = dir_hash_lookup(shard, entry.filename);
+    if (indexed == NULL)
+    {
+        return;
     }
-    new_node.size = 0; // file size
-    if (create_file(name, new_node) == -1 || (fd = create_fd_entry(new_node)) == -1 || create_inode_entry(new_node) == -1)
+    int slot = indexed->slot;
+    dir_hash_remove(shard, entry.filename); // the index points at the slot's name, drop it first
+    store_metadata(fs, &fs->dir_cache[slot], &default_dir, sizeof(dir_e));
+}
+
+/**
+ * Adds a directory entry to the root directory.
+ *
+ * @param entry The directory entry to be added.
+ * @return 1 if the directory entry was successfully added, -1 if the file system is full.
+ */
+int add_mapping(sfs_t *fs, dir_e entry)
+{
+    pthread_mutex_lock(&fs->dir_lock);
+    if (fs->num_entries >= MAX_DIRECTORIES)
     {
-        print("SFS Failed to open file.");
+        pthread_mutex_unlock(&fs->dir_lock);
+        print("File system full.");
         return -1;
     }
-    if (dir_index == -1)
-    { // send dir_entry to this entry
-    }
-    return fd;
+    add_mapping_to_root_dir(fs, entry);
+    fs->num_entries += 1;
+    pthread_mutex_unlock(&fs->dir_lock);
+    return 1;
 }
 
 /**
- * "Closes" the file by removing the entry from the FD table.
+ * Removes a directory entry from the root directory.
  *
- * @param fileId Id of the file
- * @return 0 if succesful -1 otherwise
+ * @param entry The directory entry to be removed.
+ * @return 1 if the directory entry was successfully removed, -1 if the file system is empty.
  */
-int sfs_fclose(int fileID)
+int remove_mapping(sfs_t *fs, dir_e entry)
+{
+    pthread_mutex_lock(&fs->dir_lock);
+    if (fs->num_entries == 0)
+    {
+        pthread_mutex_unlock(&fs->dir_lock);
+        print("File system empty. Nothing to remove.");
+        return -1;
+    }
+    remove_mapping_from_root_dir(fs, entry);
+    fs->num_entries -= 1;
+    pthread_mutex_unlock(&fs->dir_lock);
+    return 1;
+}
+
+/**
+ * Initializes the inode table counters from the formatted or loaded table.
+ */
+void init_inode_table(sfs_t *fs)
 {
-    return delete_fd_entry(fileID);
+    fs->inode_table.earliest_available = MAX_DIRECTORIES;
+    fs->inode_table.length = 0;
+    free(fs->inode_table.used);
+    fs->inode_table.used = malloc(MAX_DIRECTORIES);
+    for (int i = MAX_DIRECTORIES - 1; i >= 0; i--)
+    {
+        fs->inode_table.used[i] = fs->inode_table.inodes[i].uid != -1;
+        if (fs->inode_table.inodes[i].uid == -1)
+        {
+            fs->inode_table.earliest_available = i;
+        }
+        else
+        {
+            fs->inode_table.length++;
+        }
+    }
+    fs->inode_table.free_inodes = MAX_DIRECTORIES - fs->inode_table.length;
 }
 
 /**
- * Reads the some or all of the contents of a file into the buffer provided.
+ * Creates a new inode entry in the inode table.
  *
- * @param fileId Id of the file
- * @param buf Buffer to read into
- * @param length Length to read
- * @return Number of blocks read if succesful -1 otherwise
+ * @param new_node The new inode to be added, its uid is the slot it goes in.
+ * @return 1 if the inode entry was successfully created, -1 if the inode table is full.
  */
-int sfs_fwrite(int fileID, char *buf, int length)
+int create_inode_entry(sfs_t *fs, inode_s new_node)
 {
-    fdt_entry entry;
-    if ((entry = get_fd_entry(fileID)).fd == -1)
+    if (fs->inode_table.length == MAX_DIRECTORIES)
     {
-        print("File entry does not exist. Please consider creating it.");
+        print("Cannot add anymore inodes to the table");
         return -1;
     }
-    inode_s inode = entry.inode;
-    int blocks_written;
-    int *blocks = allocate_blocks(sizeof(char) * length, &blocks_written);
-    inode.size = blocks_written * BLOCK_SIZE;
-    if (blocks == NULL)
+    if (new_node.uid < 0 || new_node.uid >= MAX_DIRECTORIES || fs->inode_table.used[new_node.uid])
     {
-        print("Was unable to allocate blocks for file write");
         return -1;
     }
-    int counter = 0;
-    for (int i = 0; i < NUM_POINTERS && counter != blocks_written; i++)
+    store_metadata(fs, &fs->inode_table.inodes[new_node.uid], &new_node, sizeof(inode_s));
+    fs->inode_table.used[new_node.uid] = true;
+    fs->inode_table.free_inodes--;
+    fs->inode_table.length++;
+    while (fs->inode_table.earliest_available < MAX_DIRECTORIES && fs->inode_table.used[fs->inode_table.earliest_available])
     {
-        int set = 0;
-        for (int j = 0; j < NUM_POINTERS - 1; j++)
-        {
-            if (inode.d_pointer[j] == -1)
-            {
-                inode.d_pointer[j] = blocks[i];
-                set = 1;
-                counter++;
-                break;
-            }
-        }
-        if (set)
-        {
-            continue;
-        }
-        if (inode.in_pointer != -1)
-        {
-            inode.in_pointer = blocks[i];
-            counter++;
-        }
+        fs->inode_table.earliest_available++;
     }
-    for (int i = 0; i < blocks_written; i++)
+    return 1;
+}
+
+/**
+ * Removes an inode from the inode table based on the given uid.
+ *
+ * @param uid The unique identifier of the inode to be removed.
+ * @return The removed inode, or the default inode if no matching inode is found.
+ */
+inode_s remove_inode(sfs_t *fs, int uid)
+{
+    if (fs->inode_table.free_inodes == MAX_DIRECTORIES)
     {
-        char *to_write = (char *)malloc(BLOCK_SIZE);
-        strncpy(to_write, buf + (i * BLOCK_SIZE), BLOCK_SIZE); // copy a certain substring up to a given length
-        write_blocks(blocks[i], 1, to_write);                  // flush to disk
+        print("No inodes to remove.");
+        return default_inode;
     }
-    free(blocks);
-    entry.offset = entry.offset + blocks_written;
-    entry.inode = inode;
-    update_fd_entry(entry);
-    update_dir_entry(entry.inode);
-    return blocks_written * BLOCK_SIZE;
+    if (uid < 0 || uid >= MAX_DIRECTORIES || fs->inode_table.inodes[uid].uid != uid)
+    {
+        return default_inode;
+    }
+    inode_s node = fs->inode_table.inodes[uid];
+    store_metadata(fs, &fs->inode_table.inodes[uid], &default_inode, sizeof(inode_s));
+    fs->inode_table.used[uid] = false;
+    fs->inode_table.length--;
+    fs->inode_table.free_inodes++;
+    if (uid < fs->inode_table.earliest_available)
+    {
+        fs->inode_table.earliest_available = uid;
+    }
+    return node;
 }
 
 /**
- * Reads the some or all of the contents of a file into the buffer provided.
+ * Initializes a new inode with default values and assigns it the first free slot of the inode table.
  *
- * @param fileId Id of the file
- * @param buf Buffer to read into
- * @param length Length to read
- * @return Number of blocks read if succesful -1 otherwise
+ * @return The initialized inode.
  */
-int sfs_fread(int fileID, char *buf, int length)
+inode_s init_inode(sfs_t *fs)
 {
-    fdt_entry entry;
-    if ((entry = get_fd_entry(fileID)).fd == -1)
+    if (fs->inode_table.free_inodes == 0)
+    {
+        print("No remaining space in file system.");
+        return default_inode;
+    }
+    inode_s new_node = default_inode;
+    new_node.uid = fs->inode_table.earliest_available;
+    new_node.flags = INODE_INLINE; // files start out in the inode until they outgrow it
+    return new_node;
+}
+
+/**
+ * Returns the number of bytes of data a file can keep inline in its inode.
+ */
+int inline_capacity(sfs_t *fs)
+{
+    return INLINE_DATA_SIZE < BLOCK_SIZE ? INLINE_DATA_SIZE : BLOCK_SIZE;
+}
+
+/**
+ * Sets an inode up to map an empty file with the scheme the file system uses.
+ *
+ * @param node The inode to set up.
+ */
+void init_block_map(sfs_t *fs, inode_s *node)
+{
+    node->map = default_inode.map;
+    if (fs->sb.block_mapping == SFS_MAP_EXTENTS)
+    { // an empty leaf as the root
+        memset(&node->map.extents, 0, sizeof(extent_root));
+    }
+}
+
+/**
+ * Writes an updated inode back into the inode table.
+ *
+ * @param node The inode to store, its uid is the slot it goes in.
+ */
+void update_inode(sfs_t *fs, inode_s node)
+{
+    store_metadata(fs, &fs->inode_table.inodes[node.uid], &node, sizeof(inode_s));
+}
+
+/**
+ * Retrieves a directory entry based on the given filename. The caller holds the lock of the
+ * shard the name is in.
+ *
+ * @param filename The name of the file to retrieve the directory entry for.
+ * @return The directory entry matching the filename, or the default directory entry if no matching entry is found.
+ */
+dir_e get_dir_entry(sfs_t *fs, char *filename)
+{
+    dir_hash_entry *indexed = dir_hash_lookup(&fs->name_index[name_shard(filename)], filename);
+    if (indexed == NULL)
+    {
+        return default_dir;
+    }
+    return fs->dir_cache[indexed->slot];
+}
+
+/**
+ * Retrieves the index of the inode with the given UID.
+ * @param uid The unique identifier of the inode to retrieve the index for.
+ * @return The index of the inode with the given UID, or -1 if no matching inode is found.
+ */
+int get_inode_index(sfs_t *fs, int uid)
+{
+    if (uid < 0 || uid >= MAX_DIRECTORIES || fs->inode_table.inodes[uid].uid != uid)
     {
-        print("File entry does not exist. Please consider creating it.");
         return -1;
     }
-    inode_s inode = entry.inode;
-    int num_blocks;
-    int *blocks = get_blocks(inode, &num_blocks);
-    int start_block = entry.offset;
-    for (int i = start_block; i < num_blocks; i++)
+    return uid;
+}
+
+/**
+ * Retrieves the inode with the given UID.
+ *
+ * @param uid The unique identifier of the inode to retrieve.
+ * @return The inode with the given UID, or the default inode if no matching inode is found.
+ */
+inode_s get_inode(sfs_t *fs, int uid)
+{
+    int index;
+    if ((index = get_inode_index(fs, uid)) != -1)
     {
-        read_blocks(blocks[i], 1, buf);
+        return fs->inode_table.inodes[index];
+    }
+    else
+    {
+        return default_inode;
     }
-    free(blocks);
-    return (num_blocks - start_block) * BLOCK_SIZE;
 }
 
 /**
- * Sets the read and right pointer for a given file.
+ * Retrieves an inode from its number alone. The caller holds the inode lock, which keeps a file
+ * from changing but not a free slot from being taken by a new file, so the allocator lock that
+ * new files take their slot under is held as well.
  *
- * @param fileId Id of the file
- * @param loc New desired pointer location.
- * @return 0 if succesful -1 otherwise
+ * @param uid The unique identifier of the inode.
+ * @return The inode, or the default inode if the slot is free.
  */
-int sfs_fseek(int fileId, int loc)
+inode_s get_numbered_inode(sfs_t *fs, int uid)
+{
+    pthread_mutex_lock(&fs->alloc_lock);
+    inode_s node = get_inode(fs, uid);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return node;
+}
+
+/**
+ * Checks if a file with the given name exists in the directory cache.
+ *
+ * @param name The name of the file to check for existence.
+ * @return 1 if the file exists, 0 if it does not.
+ */
+int does_file_exist(sfs_t *fs, char *name)
 {
-    fdt_entry entry = get_fd_entry(fileId);
-    if (entry.inode.uid == -1) // receieved default entry
+    if (fs->dir_cache == NULL)
     {
-        print("INode with fileId not found");
+        print("Directory cache not initialized. Please set.");
         return -1;
     }
-    entry.offset = loc;
-    update_fd_entry(entry);
-    return 0;
+    return get_dir_entry(fs, name).inode != -1;
 }
 
 /**
- * Removes a file from the file system and reclaims any resources that file may have been using.
+ * Creates a directory entry for a file and inode.
  *
- * @param Name of the file
- * @return 0 if succesful -1 otherwise
+ * @param name The name of the file to be created.
+ * @param new_node The inode of the new file.
+ * @return 1 if the file is successfully created, -1 if the file already exists, or the file name is too long.
  */
-int sfs_remove(char *file)
+int create_file(sfs_t *fs, char *name, inode_s new_node)
 {
-    dir_e entry = get_dir_entry(file);
-    if (entry.inode.uid == -1)
-    { // received default
-        print("File set for removal not found");
-        return -1;
+    if (does_file_exist(fs, name))
+    {
+        print("File with same name already exists");
+        return 1;
     }
-    int result = remove_mapping(entry);
-    inode_s node = remove_inode(entry.inode.uid);
-    if (node.uid == -1)
-    { // received default inode
-        print("Unable to delete inode");
+
+    if (strlen(name) > MAX_FILE_NAME_LENGTH)
+    {
+        print("File name too long");
         return -1;
     }
-    int counter = count_num_blocks(entry.inode);
-    int *blocks_to_be_released = (int *)malloc(counter * sizeof(int));
-    for (int i = 0; i < NUM_POINTERS || i < counter; i++)
+
+    dir_e inode_dir = default_dir;
+    strcpy(inode_dir.filename, name);
+    inode_dir.inode = new_node.uid;
+    // update root directory
+    return add_mapping(fs, inode_dir);
+}
+
+/**
+ * Adds FD_CHUNK file descriptors to the open file descriptor table. Entries are allocated a
+ * chunk at a time into a fixed array of chunks, so entries in use never move while the table
+ * grows. The caller holds the file descriptor lock.
+ *
+ * @return 0 if successful, -1 if the table is at its maximum size or out of memory.
+ */
+int grow_fd_table(sfs_t *fs)
+{
+    if (fs->open_fd_table.size + FD_CHUNK > MAX_OPEN_FILES)
     {
-        if (i == NUM_POINTERS - 1)
+        return -1;
+    }
+    int chunk = fs->open_fd_table.size / FD_CHUNK;
+    fdt_entry **chunks = fs->open_fd_table.chunks;
+    if ((chunks[chunk] = malloc(FD_CHUNK * sizeof(fdt_entry))) == NULL)
+    {
+        return -1;
+    }
+    for (int i = FD_CHUNK - 1; i >= 0; i--)
+    { // pushed from the top, so the lowest new file descriptor is handed out first
+        chunks[chunk][i] = default_fdt_entry;
+        chunks[chunk][i].next_free = fs->open_fd_table.free_head;
+        fs->open_fd_table.free_head = fs->open_fd_table.size + i;
+    }
+    fs->open_fd_table.size += FD_CHUNK;
+    return 0;
+}
+
+/**
+ * Finds the file descriptor table entry for the given file descriptor. The caller holds the file
+ * descriptor lock.
+ *
+ * @param fd The file descriptor to find the entry for.
+ * @return The file descriptor table entry, or NULL if the file descriptor is not open.
+ */
+fdt_entry *find_fd_entry(sfs_t *fs, int fd)
+{
+    if (fd < 0 || fd >= fs->open_fd_table.size)
+    {
+        return NULL;
+    }
+    fdt_entry *entry = &fs->open_fd_table.chunks[fd / FD_CHUNK][fd % FD_CHUNK];
+    return entry->file != NULL ? entry : NULL;
+}
+
+/**
+ * Retrieves the file descriptor table entry for the given file descriptor. The lookup is made
+ * under the file descriptor lock, since another thread may be growing the table or opening and
+ * closing other file descriptors. The entry is updated in place by the caller.
+ *
+ * @param fd The file descriptor to retrieve the entry for.
+ * @return The file descriptor table entry, or NULL if the file descriptor is not open.
+ */
+fdt_entry *get_fd_entry(sfs_t *fs, int fd)
+{
+    pthread_mutex_lock(&fs->fd_lock);
+    fdt_entry *entry = find_fd_entry(fs, fd);
+    pthread_mutex_unlock(&fs->fd_lock);
+    return entry;
+}
+
+/**
+ * Retrieves the file descriptor table entry for the given file descriptor if its file still
+ * exists.
+ *
+ * @param fd The file descriptor to retrieve the entry for.
+ * @return The file descriptor table entry, or NULL if the file descriptor is not open or its
+ * file was removed.
+ */
+fdt_entry *get_open_file(sfs_t *fs, int fd)
+{
+    pthread_mutex_lock(&fs->fd_lock);
+    fdt_entry *entry = find_fd_entry(fs, fd);
+    if (entry != NULL && entry->file->inode == NULL)
+    {
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+    return entry;
+}
+
+/**
+ * Creates a new file descriptor table entry for the given inode. Every file descriptor on the
+ * same inode shares one open inode and its block map.
+ *
+ * @param node The inode for which to create the file descriptor table entry.
+ * @return The file descriptor for the newly created entry, or -1 if the maximum number of open file descriptors has been reached.
+ */
+int create_fd_entry(sfs_t *fs, inode_s node)
+{
+    pthread_mutex_lock(&fs->fd_lock);
+    if (fs->open_fd_table.free_head == -1 && grow_fd_table(fs) == -1)
+    {
+        pthread_mutex_unlock(&fs->fd_lock);
+        print("Max number of open file descriptors reached. Please close one in order to continue.");
+        return -1;
+    }
+    open_inode *file = fs->open_fd_table.inodes[node.uid];
+    if (file == NULL)
+    {
+        if ((file = calloc(1, sizeof(open_inode))) == NULL)
+        {
+            pthread_mutex_unlock(&fs->fd_lock);
+            print("Was unable to allocate an open inode.");
+            return -1;
+        }
+        file->inode = &fs->inode_table.inodes[node.uid];
+        file->uid = node.uid;
+        pthread_mutex_init(&file->lock, NULL);
+        fs->open_fd_table.inodes[node.uid] = file;
+    }
+    file->open_count++;
+    int fd = fs->open_fd_table.free_head;
+    fdt_entry *entry = &fs->open_fd_table.chunks[fd / FD_CHUNK][fd % FD_CHUNK];
+    fs->open_fd_table.free_head = entry->next_free;
+    *entry = default_fdt_entry;
+    entry->file = file;
+    entry->fd = fd;
+    entry->offset = 0; // file descriptor to end of the file
+    pthread_mutex_unlock(&fs->fd_lock);
+    return fd;
+}
+
+/**
+ * Deletes a file descriptor table entry for the given file descriptor, and the open inode with
+ * it if it was the last file descriptor on the inode.
+ *
+ * @param fd The file descriptor to delete.
+ * @return 0 if the entry is successfully deleted, -1 if the entry does not exist in the table.
+ */
+int delete_fd_entry(sfs_t *fs, int fd)
+{
+    pthread_mutex_lock(&fs->fd_lock);
+    fdt_entry *entry = find_fd_entry(fs, fd);
+    if (entry == NULL)
+    {
+        pthread_mutex_unlock(&fs->fd_lock);
+        print("File descriptor for node does not exist.");
+        return -1;
+    }
+    open_inode *file = entry->file;
+    if (--file->open_count == 0)
+    {
+        if (fs->open_fd_table.inodes[file->uid] == file)
+        {
+            fs->open_fd_table.inodes[file->uid] = NULL;
+        }
+        pthread_mutex_destroy(&file->lock);
+        free(file->block_map);
+        free(file);
+    }
+    *entry = default_fdt_entry;
+    entry->next_free = fs->open_fd_table.free_head;
+    fs->open_fd_table.free_head = fd;
+    pthread_mutex_unlock(&fs->fd_lock);
+    return 0;
+}
+
+/**
+ * Returns the number of logical blocks below one index block of the given depth, P^depth for P
+ * pointers per index block.
+ */
+long long index_span(sfs_t *fs, int depth)
+{
+    long long span = 1;
+    for (int i = 0; i < depth; i++)
+    {
+        span *= POINTERS_PER_BLOCK;
+    }
+    return span;
+}
+
+/**
+ * Returns the first logical block mapped through the indirect pointer of the given depth.
+ */
+long long indirect_base(sfs_t *fs, int depth)
+{
+    long long base = NUM_DIRECT_POINTERS;
+    for (int d = 1; d < depth; d++)
+    {
+        base += index_span(fs, d);
+    }
+    return base;
+}
+
+/**
+ * Returns the indirect pointer of an inode with the given depth, 1 for single indirect.
+ */
+int *indirect_pointer(inode_s *node, int depth)
+{
+    block_pointers *pointers = &node->map.pointers;
+    return depth == 1 ? &pointers->in_pointer : depth == 2 ? &pointers->double_in_pointer : &pointers->triple_in_pointer;
+}
+
+/**
+ * Returns the largest number of blocks a file can have: as many as the index blocks can address,
+ * capped so the size of the file in bytes still fits in an int.
+ */
+int max_file_blocks(sfs_t *fs)
+{
+    long long blocks = indirect_base(fs, MAX_INDIRECTION + 1);
+    long long cap = INT32_MAX / BLOCK_SIZE;
+    return blocks < cap ? blocks : cap;
+}
+
+/**
+ * Counts the index blocks needed to map the given number of blocks without holes.
+ */
+int index_blocks_for(sfs_t *fs, int blocks)
+{
+    int count = 0;
+    for (int depth = 1; depth <= MAX_INDIRECTION; depth++)
+    {
+        long long mapped = blocks - indirect_base(fs, depth);
+        if (mapped <= 0)
+        {
+            break;
+        }
+        if (mapped > index_span(fs, depth))
+        {
+            mapped = index_span(fs, depth);
+        }
+        for (int level = 1; level <= depth; level++)
+        { // one index block per P^level data blocks at each level of the tree
+            count += (mapped + index_span(fs, level) - 1) / index_span(fs, level);
+        }
+    }
+    return count;
+}
+
+/**
+ * Looks up the physical blocks of logical blocks [from, to) below an index block. Each index block
+ * on the way is read once however many of its entries are needed.
+ *
+ * @param block The index block, or -1 if it was never allocated.
+ * @param depth Levels of index blocks from this one down to the data, 1 if it points at data blocks.
+ * @param base First logical block below the index block.
+ * @param from First logical block to look up.
+ * @param to Logical block after the last one to look up.
+ * @param out Where the physical block of logical block from goes, followed by the rest, -1 for holes.
+ * @return 0 if successful, -1 otherwise.
+ */
+int map_index_block(sfs_t *fs, int block, int depth, long long base, int from, int to, int *out)
+{
+    if (block == -1)
+    {
+        for (int i = from; i < to; i++)
+        {
+            out[i - from] = -1;
+        }
+        return 0;
+    }
+    int *index = malloc(BLOCK_SIZE);
+    if (cache_read(fs->cache, CACHE_METADATA, block, index) == -1)
+    {
+        free(index);
+        return -1;
+    }
+    long long span = index_span(fs, depth - 1);
+    int status = 0;
+    int first = (from - base) / span;
+    int last = (to - 1 - base) / span < POINTERS_PER_BLOCK ? (to - 1 - base) / span : POINTERS_PER_BLOCK - 1;
+    if (depth > 1 && last > first)
+    { // the child index blocks are fetched with one request rather than one at a time
+        cache_prefetch(fs->cache, CACHE_METADATA, index + first, last - first + 1);
+    }
+    for (int e = first; e < POINTERS_PER_BLOCK && base + e * span < to && status == 0; e++)
+    {
+        long long child = base + e * span;
+        int lo = child > from ? child : from;
+        int hi = child + span < to ? child + span : to;
+        if (depth == 1)
+        {
+            out[lo - from] = index[e];
+        }
+        else
+        {
+            status = map_index_block(fs, index[e], depth - 1, child, lo, hi, out + (lo - from));
+        }
+    }
+    free(index);
+    return status;
+}
+
+/**
+ * Looks up the physical blocks of logical blocks [from, to) of a file mapped with pointers.
+ *
+ * @param node The inode of the file.
+ * @param from First logical block to look up.
+ * @param to Logical block after the last one to look up.
+ * @param out Where the physical block of logical block from goes, followed by the rest, -1 for holes.
+ * @return 0 if successful, -1 otherwise.
+ */
+int map_pointer_blocks(sfs_t *fs, inode_s node, int from, int to, int *out)
+{
+    for (int i = from; i < to && i < NUM_DIRECT_POINTERS; i++)
+    {
+        out[i - from] = node.map.pointers.d_pointer[i];
+    }
+    for (int depth = 1; depth <= MAX_INDIRECTION; depth++)
+    {
+        long long base = indirect_base(fs, depth);
+        long long lo = base > from ? base : from;
+        long long hi = base + index_span(fs, depth) < to ? base + index_span(fs, depth) : to;
+        if (lo < hi && map_index_block(fs, *indirect_pointer(&node, depth), depth, base, lo, hi, out + (lo - from)) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Drops the entries of an index block for logical blocks from keep on, releasing the index block
+ * itself and any below it once nothing they map is kept.
+ *
+ * @param block The index block, or -1 if it was never allocated, set to -1 once it is released.
+ * @param depth Levels of index blocks from this one down to the data, 1 if it points at data blocks.
+ * @param base First logical block below the index block.
+ * @param keep Number of logical blocks of the file to keep.
+ * @param with_data Whether the data blocks dropped go into out as well.
+ * @param out Where the blocks no longer mapped are added.
+ * @param count Number of blocks in out, updated as blocks are added.
+ * @param capacity Number of blocks out has room for.
+ * @return 0 if successful, -1 otherwise.
+ */
+int trim_index_block(sfs_t *fs, int *block, int depth, long long base, int keep, int with_data, int *out, int *count, int capacity)
+{
+    if (*block == -1 || keep >= base + index_span(fs, depth))
+    { // nothing below it is dropped
+        return 0;
+    }
+    int *index = malloc(BLOCK_SIZE);
+    if (cache_read(fs->cache, CACHE_METADATA, *block, index) == -1)
+    {
+        free(index);
+        return -1;
+    }
+    long long span = index_span(fs, depth - 1);
+    int status = 0;
+    for (int e = keep > base ? (keep - base) / span : 0; e < POINTERS_PER_BLOCK && status == 0; e++)
+    {
+        if (depth > 1)
         {
-            if (entry.inode.in_pointer != -1)
+            status = trim_index_block(fs, &index[e], depth - 1, base + e * span, keep, with_data, out, count, capacity);
+        }
+        else if (index[e] != -1)
+        {
+            if (with_data && *count < capacity)
             {
-                blocks_to_be_released[i] = entry.inode.in_pointer;
-                break;
+                out[(*count)++] = index[e];
+            }
+            index[e] = -1;
+        }
+    }
+    if (status == 0 && keep <= base)
+    { // nothing below it is kept
+        if (*count < capacity)
+        {
+            out[(*count)++] = *block;
+        }
+        *block = -1;
+    }
+    else if (status == 0 && cache_write(fs->cache, CACHE_METADATA, *block, index) == -1)
+    {
+        status = -1;
+    }
+    free(index);
+    return status;
+}
+
+/**
+ * Points logical blocks [from, to) below an index block at the given physical blocks, allocating
+ * the index block and any below it that do not exist yet. Each index block on the way is read and
+ * written once however many of its entries change.
+ *
+ * @param block The index block, set to a newly allocated one if it is -1.
+ * @param depth Levels of index blocks from this one down to the data, 1 if it points at data blocks.
+ * @param base First logical block below the index block.
+ * @param from First logical block to set.
+ * @param to Logical block after the last one to set.
+ * @param blocks The physical block for logical block from, followed by the rest.
+ * @return 0 if successful, -1 otherwise.
+ */
+int store_index_block(sfs_t *fs, int *block, int depth, long long base, int from, int to, const int *blocks)
+{
+    int *index = malloc(BLOCK_SIZE);
+    int fresh = *block == -1;
+    if (fresh)
+    {
+        int length;
+        if ((*block = allocate_extent(fs, -1, 1, &length)) == -1)
+        {
+            print("Do not have enough blocks left for index blocks.");
+            free(index);
+            return -1;
+        }
+        memset(index, 0xff, BLOCK_SIZE); // every entry -1
+    }
+    else if (cache_read(fs->cache, CACHE_METADATA, *block, index) == -1)
+    {
+        free(index);
+        return -1;
+    }
+    int *previous = malloc(BLOCK_SIZE);
+    memcpy(previous, index, BLOCK_SIZE);
+    long long span = index_span(fs, depth - 1);
+    int status = 0;
+    for (int e = (from - base) / span; e < POINTERS_PER_BLOCK && base + e * span < to && status == 0; e++)
+    {
+        long long child = base + e * span;
+        int lo = child > from ? child : from;
+        int hi = child + span < to ? child + span : to;
+        if (depth == 1)
+        {
+            index[e] = blocks[lo - from];
+        }
+        else
+        {
+            status = store_index_block(fs, &index[e], depth - 1, child, lo, hi, blocks + (lo - from));
+        }
+    }
+    if (cache_write(fs->cache, CACHE_METADATA, *block, index) == -1)
+    { // written even when a block below it failed, so it never points at one that was not
+        int capacity = (to - from) + depth;
+        int *dropped = malloc(capacity * sizeof(int));
+        int count = 0;
+        for (int e = 0; depth > 1 && e < POINTERS_PER_BLOCK; e++)
+        { // index blocks made below it are out of reach of the copy on disk
+            if (previous[e] == -1)
+            {
+                trim_index_block(fs, &index[e], depth - 1, base + e * span, base + e * span, false, dropped, &count, capacity);
             }
         }
-        if (entry.inode.d_pointer[i] != -1)
+        if (fresh && count < capacity)
+        {
+            dropped[count++] = *block;
+            *block = -1;
+        }
+        release_blocks(fs, dropped, count);
+        free(dropped);
+        status = -1;
+    }
+    free(previous);
+    free(index);
+    return status;
+}
+
+/**
+ * Points logical blocks [from, to) of a file mapped with pointers at the given physical blocks.
+ *
+ * @param node The inode of the file, its pointers are updated in place.
+ * @param from First logical block to set.
+ * @param to Logical block after the last one to set.
+ * @param blocks The physical block for logical block from, followed by the rest.
+ * @return 0 if successful, -1 otherwise.
+ */
+int store_pointer_blocks(sfs_t *fs, inode_s *node, int from, int to, const int *blocks)
+{
+    for (int i = from; i < to && i < NUM_DIRECT_POINTERS; i++)
+    {
+        node->map.pointers.d_pointer[i] = blocks[i - from];
+    }
+    for (int depth = 1; depth <= MAX_INDIRECTION; depth++)
+    {
+        long long base = indirect_base(fs, depth);
+        long long lo = base > from ? base : from;
+        long long hi = base + index_span(fs, depth) < to ? base + index_span(fs, depth) : to;
+        if (lo < hi && store_index_block(fs, indirect_pointer(node, depth), depth, base, lo, hi, blocks + (lo - from)) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Drops the pointers of a file mapped with pointers to logical blocks from keep on.
+ *
+ * @param node The inode of the file, its pointers are updated in place.
+ * @param keep Number of logical blocks of the file to keep.
+ * @param with_data Whether the data blocks dropped go into out as well.
+ * @param out Where the blocks no longer mapped are added.
+ * @param count Number of blocks in out, updated as blocks are added.
+ * @param capacity Number of blocks out has room for.
+ * @return 0 if successful, -1 otherwise.
+ */
+int trim_pointer_blocks(sfs_t *fs, inode_s *node, int keep, int with_data, int *out, int *count, int capacity)
+{
+    for (int i = keep; i < NUM_DIRECT_POINTERS; i++)
+    {
+        if (with_data && node->map.pointers.d_pointer[i] != -1 && *count < capacity)
+        {
+            out[(*count)++] = node->map.pointers.d_pointer[i];
+        }
+        node->map.pointers.d_pointer[i] = -1;
+    }
+    for (int depth = 1; depth <= MAX_INDIRECTION; depth++)
+    {
+        if (trim_index_block(fs, indirect_pointer(node, depth), depth, indirect_base(fs, depth), keep, with_data, out, count, capacity) == -1)
         {
-            blocks_to_be_released[i] = entry.inode.d_pointer[i];
+            return -1;
         }
     }
-    release_blocks(blocks_to_be_released, counter);
     return 0;
 }
+
+/**
+ * Returns how many entries fit in an extent tree node of the given depth.
+ *
+ * @param depth Depth of the node, 0 for a leaf.
+ * @param in_inode Whether the node is the root kept in the inode rather than a block of its own.
+ */
+int extent_capacity(sfs_t *fs, int depth, int in_inode)
+{
+    int bytes = (in_inode ? (int)sizeof(extent_root) : BLOCK_SIZE) - (int)sizeof(extent_header);
+    return bytes / (depth == 0 ? sizeof(file_extent) : sizeof(extent_child));
+}
+
+/**
+ * Returns the extents of a leaf node.
+ */
+file_extent *node_extents(extent_header *node)
+{
+    return (file_extent *)(node + 1);
+}
+
+/**
+ * Returns the children of an interior node.
+ */
+extent_child *node_children(extent_header *node)
+{
+    return (extent_child *)(node + 1);
+}
+
+/**
+ * Returns the first logical block below an entry of a node.
+ */
+int entry_logical(extent_header *node, int i)
+{
+    return node->depth == 0 ? node_extents(node)[i].logical : node_children(node)[i].logical;
+}
+
+/**
+ * Binary searches a node for the last entry starting at or before the given logical block.
+ *
+ * @param node The node to search.
+ * @param logical The logical block to look for.
+ * @return Index of the entry, 0 if every entry starts after the block.
+ */
+int find_extent_entry(extent_header *node, int logical)
+{
+    int lo = 0;
+    int hi = node->count - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (entry_logical(node, mid) <= logical)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Looks up the physical blocks of logical blocks [from, to) below an extent tree node. Only the
+ * children overlapping the range are read, each of them once.
+ *
+ * @param node The node.
+ * @param from First logical block to look up.
+ * @param to Logical block after the last one to look up.
+ * @param out Where the physical block of logical block from goes, followed by the rest. Entries
+ *            outside every extent are left as they are.
+ * @return 0 if successful, -1 otherwise.
+ */
+int map_extent_node(sfs_t *fs, extent_header *node, int from, int to, int *out)
+{
+    int i = find_extent_entry(node, from);
+    if (node->depth == 0)
+    {
+        file_extent *extents = node_extents(node);
+        for (; i < node->count && extents[i].logical < to; i++)
+        {
+            int lo = extents[i].logical > from ? extents[i].logical : from;
+            int hi = extents[i].logical + extents[i].length < to ? extents[i].logical + extents[i].length : to;
+            for (int b = lo; b < hi; b++)
+            {
+                out[b - from] = extents[i].physical + (b - extents[i].logical);
+            }
+        }
+        return 0;
+    }
+    extent_child *children = node_children(node);
+    char *block = malloc(BLOCK_SIZE);
+    int status = 0;
+    for (; i < node->count && children[i].logical < to && status == 0; i++)
+    {
+        if (cache_read(fs->cache, CACHE_METADATA, children[i].block, block) == -1)
+        {
+            status = -1;
+            break;
+        }
+        status = map_extent_node(fs, (extent_header *)block, from, to, out);
+    }
+    free(block);
+    return status;
+}
+
+/**
+ * Appends an extent after every extent below a node, merging it into the last one when the two are
+ * contiguous. Files only ever grow at the end, so a full node is never split: the new entry starts
+ * a sibling at the same depth instead.
+ *
+ * @param node The node, updated in place.
+ * @param in_inode Whether the node is the root kept in the inode.
+ * @param e The extent to append.
+ * @param sibling Set to the new sibling when one is started.
+ * @return 0 if the extent went below the node, 1 if it went into a new sibling, -1 on error.
+ */
+int append_extent_node(sfs_t *fs, extent_header *node, int in_inode, file_extent e, extent_child *sibling)
+{
+    extent_child child;
+    if (node->depth == 0)
+    {
+        file_extent *last = node->count > 0 ? &node_extents(node)[node->count - 1] : NULL;
+        if (last != NULL && last->logical + last->length == e.logical && last->physical + last->length == e.physical)
+        {
+            last->length += e.length;
+            return 0;
+        }
+        if (node->count < extent_capacity(fs, 0, in_inode))
+        {
+            node_extents(node)[node->count++] = e;
+            return 0;
+        }
+    }
+    else
+    {
+        int last = node_children(node)[node->count - 1].block;
+        char *block = malloc(BLOCK_SIZE);
+        int status = cache_read(fs->cache, CACHE_METADATA, last, block) == -1 ? -1 : append_extent_node(fs, (extent_header *)block, 0, e, &child);
+        if (status != -1 && cache_write(fs->cache, CACHE_METADATA, last, block) == -1)
+        {
+            status = -1;
+        }
+        free(block);
+        if (status != 1)
+        {
+            return status;
+        }
+        if (node->count < extent_capacity(fs, node->depth, in_inode))
+        {
+            node_children(node)[node->count++] = child;
+            return 0;
+        }
+    }
+    int length;
+    int address = allocate_extent(fs, -1, 1, &length);
+    if (address == -1)
+    {
+        print("Do not have enough blocks left for extent tree nodes.");
+        return -1;
+    }
+    extent_header *fresh = calloc(1, BLOCK_SIZE);
+    fresh->count = 1;
+    fresh->depth = node->depth;
+    if (node->depth == 0)
+    {
+        node_extents(fresh)[0] = e;
+    }
+    else
+    {
+        node_children(fresh)[0] = child;
+    }
+    int status = cache_write(fs->cache, CACHE_METADATA, address, fresh) == -1 ? -1 : 1;
+    if (status == -1)
+    {
+        release_blocks(fs, &address, 1);
+    }
+    sibling->logical = entry_logical(fresh, 0);
+    sibling->block = address;
+    free(fresh);
+    return status;
+}
+
+/**
+ * Appends an extent to a file, moving the root of the tree out of the inode and adding a level
+ * above it once the root is full.
+ *
+ * @param node The inode of the file, updated in place.
+ * @param e The extent to append, it has to start right after the last block of the file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int append_extent(sfs_t *fs, inode_s *node, file_extent e)
+{
+    extent_header *root = &node->map.extents.header;
+    extent_child sibling;
+    int status = append_extent_node(fs, root, 1, e, &sibling);
+    if (status != 1)
+    {
+        return status;
+    }
+    int length;
+    int address = allocate_extent(fs, -1, 1, &length);
+    if (address == -1)
+    {
+        print("Do not have enough blocks left for extent tree nodes.");
+        return -1;
+    }
+    char *block = calloc(1, BLOCK_SIZE);
+    memcpy(block, root, sizeof(extent_root)); // same layout in a block, with room to spare
+    status = cache_write(fs->cache, CACHE_METADATA, address, block) == -1 ? -1 : 0;
+    free(block);
+    if (status == -1)
+    {
+        release_blocks(fs, &address, 1);
+        return -1;
+    }
+    extent_child *children = node_children(root);
+    children[0].logical = entry_logical(root, 0);
+    children[0].block = address;
+    children[1] = sibling;
+    root->count = 2;
+    root->depth++;
+    return status;
+}
+
+/**
+ * Returns an upper bound on the extent tree nodes needed to append the given number of extents
+ * to a file.
+ *
+ * @param node The inode of the file.
+ * @param extents Number of extents to append.
+ */
+int extent_nodes_for(sfs_t *fs, inode_s node, int extents)
+{
+    extent_header *root = &node.map.extents.header;
+    if (root->depth == 0 && root->count + extents <= extent_capacity(fs, 0, true))
+    {
+        return 0;
+    }
+    int nodes = 1; // the root moving out of the inode
+    int added = extents;
+    for (int depth = 0; depth <= root->depth + 1; depth++)
+    { // each level can need one node per full node of new entries, plus one it has started
+        added = added / extent_capacity(fs, depth, 0) + 1;
+        nodes += added;
+    }
+    return nodes;
+}
+
+/**
+ * Collects the blocks holding the nodes below an extent tree node.
+ *
+ * @param node The node.
+ * @param out Where the blocks are added.
+ * @param count Number of blocks in out, updated as blocks are added.
+ * @param capacity Number of blocks out has room for.
+ */
+void collect_extent_nodes(sfs_t *fs, extent_header *node, int *out, int *count, int capacity)
+{
+    if (node->depth == 0)
+    {
+        return;
+    }
+    char *block = malloc(BLOCK_SIZE);
+    for (int i = 0; i < node->count && *count < capacity; i++)
+    {
+        out[(*count)++] = node_children(node)[i].block;
+        if (cache_read(fs->cache, CACHE_METADATA, node_children(node)[i].block, block) != -1)
+        {
+            collect_extent_nodes(fs, (extent_header *)block, out, count, capacity);
+        }
+    }
+    free(block);
+}
+
+/**
+ * Drops the parts of the extents below an extent tree node that map logical blocks from keep on,
+ * releasing the nodes below it left without entries. Extents are kept in order, so what is left
+ * of every node is a prefix of its entries.
+ *
+ * @param node The node, updated in place.
+ * @param keep Number of logical blocks of the file to keep.
+ * @param with_data Whether the data blocks dropped go into out as well.
+ * @param out Where the blocks no longer mapped are added.
+ * @param count Number of blocks in out, updated as blocks are added.
+ * @param capacity Number of blocks out has room for.
+ * @return 0 if successful, -1 otherwise.
+ */
+int trim_extent_node(sfs_t *fs, extent_header *node, int keep, int with_data, int *out, int *count, int capacity)
+{
+    int kept = node->count > 0 ? find_extent_entry(node, keep) : 0;
+    if (node->depth == 0)
+    {
+        for (int i = kept; i < node->count; i++)
+        {
+            file_extent *e = &node_extents(node)[i];
+            for (int b = e->logical > keep ? e->logical : keep; with_data && b < e->logical + e->length && *count < capacity; b++)
+            {
+                out[(*count)++] = e->physical + (b - e->logical);
+            }
+            if (e->logical < keep)
+            {
+                e->length = e->logical + e->length < keep ? e->length : keep - e->logical;
+                kept = i + 1;
+            }
+        }
+        node->count = kept;
+        return 0;
+    }
+    char *block = malloc(BLOCK_SIZE);
+    int status = 0;
+    for (int i = kept; i < node->count && status == 0; i++)
+    {
+        extent_child *child = &node_children(node)[i];
+        if (cache_read(fs->cache, CACHE_METADATA, child->block, block) == -1 || trim_extent_node(fs, (extent_header *)block, keep, with_data, out, count, capacity) == -1)
+        {
+            status = -1;
+        }
+        else if (((extent_header *)block)->count == 0)
+        { // everything below it is dropped
+            if (*count < capacity)
+            {
+                out[(*count)++] = child->block;
+            }
+        }
+        else if (cache_write(fs->cache, CACHE_METADATA, child->block, block) == -1)
+        {
+            status = -1;
+        }
+        else
+        {
+            kept = i + 1;
+        }
+    }
+    free(block);
+    node->count = status == 0 ? kept : node->count;
+    return status;
+}
+
+/**
+ * Looks up the physical blocks of logical blocks [from, to) of a file.
+ *
+ * @param node The inode of the file.
+ * @param from First logical block to look up.
+ * @param to Logical block after the last one to look up.
+ * @param out Where the physical block of logical block from goes, followed by the rest, -1 for holes.
+ * @return 0 if successful, -1 otherwise.
+ */
+int map_blocks(sfs_t *fs, inode_s node, int from, int to, int *out)
+{
+    if (fs->sb.block_mapping == SFS_MAP_POINTERS)
+    {
+        return map_pointer_blocks(fs, node, from, to, out);
+    }
+    for (int i = from; i < to; i++)
+    {
+        out[i - from] = -1;
+    }
+    return map_extent_node(fs, &node.map.extents.header, from, to, out);
+}
+
+/**
+ * Points logical blocks [from, to) of a file at the given physical blocks. With extents the blocks
+ * have to go right after the last block of the file, and each contiguous run becomes one extent.
+ *
+ * @param node The inode of the file, updated in place.
+ * @param from First logical block to set.
+ * @param to Logical block after the last one to set.
+ * @param blocks The physical block for logical block from, followed by the rest.
+ * @return 0 if successful, -1 otherwise.
+ */
+int store_blocks(sfs_t *fs, inode_s *node, int from, int to, const int *blocks)
+{
+    if (fs->sb.block_mapping == SFS_MAP_POINTERS)
+    {
+        return store_pointer_blocks(fs, node, from, to, blocks);
+    }
+    for (int i = from; i < to;)
+    {
+        file_extent e = {.logical = i, .physical = blocks[i - from], .length = 1};
+        while (i + e.length < to && blocks[i + e.length - from] == e.physical + e.length)
+        {
+            e.length++;
+        }
+        if (append_extent(fs, node, e) == -1)
+        {
+            return -1;
+        }
+        i += e.length;
+    }
+    return 0;
+}
+
+/**
+ * Collects an index block and every index block below it.
+ *
+ * @param block The index block, or -1 if it was never allocated.
+ * @param depth Levels of index blocks from this one down to the data, 1 if it points at data blocks.
+ * @param out Where the index blocks are added.
+ * @param count Number of blocks in out, updated as blocks are added.
+ * @param capacity Number of blocks out has room for.
+ */
+void collect_index_blocks(sfs_t *fs, int block, int depth, int *out, int *count, int capacity)
+{
+    if (block == -1 || *count == capacity)
+    {
+        return;
+    }
+    out[(*count)++] = block;
+    if (depth == 1)
+    {
+        return;
+    }
+    int *index = malloc(BLOCK_SIZE);
+    if (cache_read(fs->cache, CACHE_METADATA, block, index) != -1)
+    {
+        for (int e = 0; e < POINTERS_PER_BLOCK; e++)
+        {
+            collect_index_blocks(fs, index[e], depth - 1, out, count, capacity);
+        }
+    }
+    free(index);
+}
+
+/**
+ * Makes room in the block map of an open file for the given number of logical blocks.
+ *
+ * @param file The open inode, its map is grown in place.
+ * @param upto Number of logical blocks the map needs room for.
+ */
+void reserve_block_map(open_inode *file, int upto)
+{
+    if (upto > file->map_capacity || file->block_map == NULL)
+    {
+        int capacity = file->map_capacity > 0 ? file->map_capacity : 16;
+        while (capacity < upto)
+        {
+            capacity *= 2;
+        }
+        file->block_map = realloc(file->block_map, capacity * sizeof(int));
+        file->map_capacity = capacity;
+    }
+}
+
+/**
+ * Returns the logical to physical block map of an open file, looking up whatever part of the first
+ * upto blocks it does not hold yet. Blocks of a file never move while it exists, so each one is
+ * looked up at most once while the file is open, whichever file descriptor asks.
+ *
+ * @param file The open inode, its map is grown in place.
+ * @param node The inode of the file.
+ * @param upto Number of logical blocks the map has to cover.
+ * @return The block map, or NULL if an index block could not be read.
+ */
+int *file_block_map(sfs_t *fs, open_inode *file, inode_s node, int upto)
+{
+    reserve_block_map(file, upto);
+    if (upto > file->mapped)
+    {
+        if (map_blocks(fs, node, file->mapped, upto, file->block_map + file->mapped) == -1)
+        {
+            return NULL;
+        }
+        file->mapped = upto;
+    }
+    return file->block_map;
+}
+
+/**
+ * Detaches the open inode of a removed file from the inode table. File descriptors still open on
+ * it fail until they are closed, and a new file reusing the inode gets an open inode of its own.
+ *
+ * @param uid The unique identifier of the inode.
+ */
+void detach_open_inode(sfs_t *fs, int uid)
+{
+    pthread_mutex_lock(&fs->fd_lock);
+    open_inode *file = fs->open_fd_table.inodes[uid];
+    if (file != NULL)
+    {
+        file->inode = NULL;
+        file->mapped = 0;
+        fs->open_fd_table.inodes[uid] = NULL;
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+}
+
+/**
+ * Allocates blocks on disk for a file based on the given number of bytes, in as few contiguous
+ * runs as the free space allows. Room is also left for the index blocks or extent tree nodes the
+ * file will need to map them.
+ *
+ * @param node The inode of the file, the blocks go after its last block.
+ * @param bytes The number of bytes for which to allocate blocks.
+ * @param goal Block the allocation should ideally start at, or -1 for no preference.
+ * @param blocks_written A pointer to an integer where the number of blocks written will be stored.
+ * @param reserved A pointer to an integer where the number of blocks set aside for the index
+ * blocks will be stored, to be handed back with unreserve_blocks once they are stored.
+ * @return An array of integers representing the allocated blocks, or NULL if allocation is not possible.
+ */
+int *allocate_blocks(sfs_t *fs, inode_s node, int bytes, int goal, int *blocks_written, int *reserved)
+{
+    int blocks_needed = blocks_for(bytes, BLOCK_SIZE); // round up in case of imperfect division
+    int first = blocks_for(node.size, BLOCK_SIZE);
+    if ((long long)first + blocks_needed > max_file_blocks(fs))
+    {
+        print("File would grow past the maximum file size.");
+        return NULL;
+    }
+    int index_needed = fs->sb.block_mapping == SFS_MAP_POINTERS ? index_blocks_for(fs, first + blocks_needed) - index_blocks_for(fs, first) : extent_nodes_for(fs, node, blocks_needed);
+    pthread_mutex_lock(&fs->alloc_lock);
+    int blocks_available = get_blocks_available(fs);
+    if (blocks_needed + index_needed > blocks_available)
+    {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        print("Do not have enough blocks left to support allocation.");
+        return NULL;
+    }
+    int *blocks_allocated = (int *)malloc(blocks_needed * sizeof(int));
+    int counter = 0;
+    while (counter != blocks_needed)
+    { // each pass takes one contiguous run
+        int length;
+        int start = allocate_extent(fs, goal, blocks_needed - counter, &length);
+        for (int i = 0; i < length; i++)
+        {
+            blocks_allocated[counter++] = start + i;
+        }
+        goal = start + length;
+    }
+    fs->reserved_blocks += index_needed;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    *blocks_written = blocks_needed;
+    *reserved = index_needed;
+    return blocks_allocated;
+}
+
+/**
+ * Hands back the blocks allocate_blocks set aside for index blocks, once the blocks it allocated
+ * are stored and took what they needed.
+ *
+ * @param reserved Number of blocks set aside.
+ */
+void unreserve_blocks(sfs_t *fs, int reserved)
+{
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->reserved_blocks -= reserved;
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/**
+ * Retrieves the blocks allocated to the given inode, its data blocks followed by its index blocks.
+ *
+ * @param node The inode for which to retrieve the allocated blocks.
+ * @param num_blocks A pointer to an integer where the number of allocated blocks will be stored.
+ * @return An array of integers representing the allocated blocks.
+ */
+int *get_blocks(sfs_t *fs, inode_s node, int *num_blocks)
+{
+    if (node.flags & INODE_INLINE)
+    {
+        *num_blocks = 0;
+        return malloc(sizeof(int));
+    }
+    int data = blocks_for(node.size, BLOCK_SIZE);
+    int capacity = data + (fs->sb.block_mapping == SFS_MAP_POINTERS ? index_blocks_for(fs, data) : data + 1); // a tree never has more nodes than extents, nor more extents than blocks
+    int *blocks_allocated = (int *)malloc((capacity + 1) * sizeof(int));
+    int counter = 0;
+    if (map_blocks(fs, node, 0, data, blocks_allocated) != -1)
+    {
+        for (int i = 0; i < data; i++)
+        { // skip holes
+            if (blocks_allocated[i] != -1)
+            {
+                blocks_allocated[counter++] = blocks_allocated[i];
+            }
+        }
+    }
+    if (fs->sb.block_mapping == SFS_MAP_EXTENTS)
+    {
+        collect_extent_nodes(fs, &node.map.extents.header, blocks_allocated, &counter, capacity);
+    }
+    for (int depth = 1; depth <= MAX_INDIRECTION && fs->sb.block_mapping == SFS_MAP_POINTERS; depth++)
+    {
+        collect_index_blocks(fs, *indirect_pointer(&node, depth), depth, blocks_allocated, &counter, capacity);
+    }
+    *num_blocks = counter;
+    return blocks_allocated;
+}
+
+/**
+ * Cuts the block map of a file back to its first keep blocks, releasing the index blocks or extent
+ * tree nodes that are no longer needed.
+ *
+ * @param node The inode of the file, its map is updated in place.
+ * @param keep Number of logical blocks of the file to keep.
+ * @param mapped Number of logical blocks the map covers, the ones past keep included.
+ * @param with_data Whether the data blocks past keep are released as well, rather than by the caller.
+ * @return 0 if successful, -1 otherwise.
+ */
+int trim_blocks(sfs_t *fs, inode_s *node, int keep, int mapped, int with_data)
+{
+    int capacity = mapped + (fs->sb.block_mapping == SFS_MAP_POINTERS ? index_blocks_for(fs, mapped) : mapped + 1);
+    int *released = malloc((capacity + 1) * sizeof(int));
+    int counter = 0;
+    int status;
+    if (fs->sb.block_mapping == SFS_MAP_POINTERS)
+    {
+        status = trim_pointer_blocks(fs, node, keep, with_data, released, &counter, capacity);
+    }
+    else
+    {
+        extent_header *root = &node->map.extents.header;
+        status = trim_extent_node(fs, root, keep, with_data, released, &counter, capacity);
+        if (status == 0 && root->depth > 0 && root->count == 0)
+        { // back to an empty leaf
+            init_block_map(fs, node);
+        }
+    }
+    if (status == 0)
+    {
+        release_blocks(fs, released, counter);
+    }
+    free(released);
+    return status;
+}
+
+/**
+ * Returns the part of a block of a file that a byte range covers.
+ *
+ * @param block Logical block of the file.
+ * @param start First byte of the range.
+ * @param length Number of bytes in the range.
+ * @param lo Set to the first byte of the block in the range.
+ * @param hi Set to the byte of the block after the last one in the range.
+ */
+void block_span(sfs_t *fs, int block, int start, int length, int *lo, int *hi)
+{
+    long long block_start = (long long)block * BLOCK_SIZE;
+    *lo = start > block_start ? start - block_start : 0;
+    *hi = start + length < block_start + BLOCK_SIZE ? start + length - block_start : BLOCK_SIZE;
+}
+
+/**
+ * Writes bytes [start, start + length) of a file in a single vectored request. Whole blocks go
+ * straight from buf. A block the range only partly covers is read first so the rest of it
+ * survives, unless it is past the old end of the file and so starts out as zeros. New blocks
+ * between the old end of the file and start are written as zeros.
+ *
+ * @param map Physical block of each logical block of the file, new ones included.
+ * @param old_blocks Number of blocks the file had before the write.
+ * @param start First byte to write.
+ * @param buf The bytes to write.
+ * @param length Number of bytes to write, at least 1.
+ * @return 0 if successful, -1 otherwise.
+ */
+int write_file_range(sfs_t *fs, const int *map, int old_blocks, int start, const char *buf, int length)
+{
+    int first = start / BLOCK_SIZE;
+    int last = (start + length - 1) / BLOCK_SIZE;
+    int from = first < old_blocks ? first : old_blocks;
+    int count = last - from + 1;
+    block_vec *vec = malloc(count * sizeof(block_vec));
+    block_vec reads[2];
+    int num_reads = 0;
+    char *edges = malloc(2 * BLOCK_SIZE); // first and last block when partly written
+    for (int b = from; b <= last; b++)
+    {
+        int lo, hi;
+        block_span(fs, b, start, length, &lo, &hi);
+        vec[b - from].address = map[b];
+        if (b < first)
+        {
+            vec[b - from].buffer = fs->empty_block;
+        }
+        else if (lo == 0 && hi == BLOCK_SIZE)
+        {
+            vec[b - from].buffer = (char *)buf + ((long long)b * BLOCK_SIZE - start);
+        }
+        else
+        {
+            char *edge = edges + (b == first ? 0 : BLOCK_SIZE);
+            vec[b - from].buffer = edge;
+            if (b < old_blocks)
+            { // read-modify-write
+                reads[num_reads].address = map[b];
+                reads[num_reads].buffer = edge;
+                num_reads++;
+            }
+            else
+            {
+                memset(edge, 0, BLOCK_SIZE);
+            }
+        }
+    }
+    int status = num_reads > 0 && cache_readv(fs->cache, CACHE_DATA, reads, num_reads) == -1 ? -1 : 0;
+    for (int b = first; b <= last && status == 0; b += (last > first ? last - first : 1))
+    { // fill in the partly written blocks
+        int lo, hi;
+        block_span(fs, b, start, length, &lo, &hi);
+        if (lo != 0 || hi != BLOCK_SIZE)
+        {
+            memcpy((char *)vec[b - from].buffer + lo, buf + ((long long)b * BLOCK_SIZE + lo - start), hi - lo);
+        }
+    }
+    if (status == 0 && cache_writev(fs->cache, CACHE_DATA, vec, count) == -1) // adjacent blocks reach the disk as one request
+    {
+        status = -1;
+    }
+    free(edges);
+    free(vec);
+    return status;
+}
+
+/**
+ * Reads bytes [start, start + length) of a file in a single vectored request. Whole blocks land
+ * straight in buf, only the first and last block go through a buffer when partly read.
+ *
+ * @param map Physical block of each logical block of the file.
+ * @param start First byte to read.
+ * @param buf Where the bytes go.
+ * @param length Number of bytes to read, at least 1.
+ * @return 0 if successful, -1 otherwise.
+ */
+int read_file_range(sfs_t *fs, const int *map, int start, char *buf, int length)
+{
+    int first = start / BLOCK_SIZE;
+    int last = (start + length - 1) / BLOCK_SIZE;
+    int count = last - first + 1;
+    if (disk_map_block(fs->disk, map[first]) != NULL) // disk is memory mapped, copy straight out of it
+    {
+        for (int b = first; b <= last; b++)
+        {
+            int lo, hi;
+            block_span(fs, b, start, length, &lo, &hi);
+            memcpy(buf + ((long long)b * BLOCK_SIZE + lo - start), (char *)disk_map_block(fs->disk, map[b]) + lo, hi - lo);
+        }
+        return 0;
+    }
+    block_vec *vec = malloc(count * sizeof(block_vec));
+    char *edges = malloc(2 * BLOCK_SIZE); // first and last block when partly read
+    for (int b = first; b <= last; b++)
+    {
+        int lo, hi;
+        block_span(fs, b, start, length, &lo, &hi);
+        vec[b - first].address = map[b];
+        vec[b - first].buffer = lo == 0 && hi == BLOCK_SIZE ? buf + ((long long)b * BLOCK_SIZE - start) : edges + (b == first ? 0 : BLOCK_SIZE);
+    }
+    int status = cache_readv(fs->cache, CACHE_DATA, vec, count) == -1 ? -1 : 0; // adjacent missing blocks are fetched with a single request
+    for (int b = first; b <= last && status == 0; b += (last > first ? last - first : 1))
+    { // copy out the partly read blocks
+        int lo, hi;
+        block_span(fs, b, start, length, &lo, &hi);
+        if (lo != 0 || hi != BLOCK_SIZE)
+        {
+            memcpy(buf + ((long long)b * BLOCK_SIZE + lo - start), (char *)vec[b - first].buffer + lo, hi - lo);
+        }
+    }
+    free(edges);
+    free(vec);
+    return status;
+}
+
+/**
+ * Reads ahead of a sequential reader. A read that starts in the block the previous one ended in,
+ * or right after it, doubles the read-ahead window up to MAX_READAHEAD blocks, any other read
+ * closes it. Once less than half a window is left ahead of the reader, the blocks up to a full
+ * window past the read are fetched into the block cache with a single request.
+ *
+ * @param entry The open file, its read-ahead state is updated in place.
+ * @param node The inode of the file.
+ * @param first First logical block of the read.
+ * @param last Last logical block of the read.
+ */
+void read_ahead(sfs_t *fs, fdt_entry *entry, inode_s node, int first, int last)
+{
+    if (first == entry->next_block || first == entry->next_block - 1)
+    {
+        entry->readahead = entry->readahead == 0 ? MIN_READAHEAD : entry->readahead * 2;
+        entry->readahead = entry->readahead < MAX_READAHEAD ? entry->readahead : MAX_READAHEAD;
+    }
+    else
+    {
+        entry->readahead = 0;
+        entry->prefetched = 0;
+    }
+    entry->next_block = last + 1;
+    if (entry->readahead == 0 || entry->prefetched - (last + 1) >= entry->readahead / 2)
+    {
+        return;
+    }
+    int from = entry->prefetched > last + 1 ? entry->prefetched : last + 1;
+    int to = last + 1 + entry->readahead;
+    int blocks = blocks_for(node.size, BLOCK_SIZE);
+    to = to < blocks ? to : blocks;
+    if (from >= to)
+    {
+        return;
+    }
+    if (to > entry->file->mapped)
+    { // look far ahead, so the blocks mapping the file are read in a few large requests
+        long long horizon = to + (long long)MAP_AHEAD * MAX_READAHEAD;
+        file_block_map(fs, entry->file, node, horizon < blocks ? horizon : blocks);
+    }
+    int *map = file_block_map(fs, entry->file, node, to);
+    int fetched = map == NULL ? -1 : cache_prefetch(fs->cache, CACHE_DATA, map + from, to - from);
+    if (fetched > 0)
+    {
+        entry->prefetched = from + fetched;
+    }
+}
+
+/**
+ * Returns the number of bytes of a file that its blocks have room for. Whatever the file holds
+ * past them is delayed. An inline file has no blocks, its data moves into the delayed blocks
+ * once it outgrows the inode.
+ *
+ * @param node The inode of the file.
+ * @return The offset the delayed part of the file starts at.
+ */
+long long allocated_bytes(sfs_t *fs, inode_s node)
+{
+    return node.flags & INODE_INLINE ? 0 : blocks_for(node.size, BLOCK_SIZE) * BLOCK_SIZE;
+}
+
+/**
+ * Returns the size of a file, delayed writes included.
+ *
+ * @param node The inode of the file.
+ * @return The size in bytes.
+ */
+int file_size(sfs_t *fs, inode_s node)
+{
+    return fs->delayed[node.uid].blocks > 0 ? fs->delayed[node.uid].size : node.size;
+}
+
+/**
+ * Keeps bytes written past the allocated part of a file in memory, without choosing blocks for
+ * them yet. An inline file hands its data over to the delayed blocks first.
+ *
+ * @param node The inode of the file.
+ * @param start First byte to write, at or past the allocated part of the file.
+ * @param buf The bytes to write.
+ * @param length Number of bytes to write.
+ */
+void delay_write(sfs_t *fs, inode_s node, int start, const char *buf, int length)
+{
+    delayed_data *d = &fs->delayed[node.uid];
+    if (d->blocks == 0)
+    {
+        d->size = node.size;
+    }
+    long long base = allocated_bytes(fs, node);
+    int blocks = blocks_for(start + length - base, BLOCK_SIZE);
+    if (blocks > d->capacity)
+    {
+        int capacity = d->capacity > 0 ? d->capacity : 1;
+        while (capacity < blocks)
+        {
+            capacity *= 2;
+        }
+        d->data = realloc(d->data, (size_t)capacity * BLOCK_SIZE);
+        d->capacity = capacity;
+    }
+    if (blocks > d->blocks)
+    { // new blocks read as zeros up to where the write starts
+        memset(d->data + (size_t)d->blocks * BLOCK_SIZE, 0, (size_t)(blocks - d->blocks) * BLOCK_SIZE);
+        if (d->blocks == 0 && node.flags & INODE_INLINE)
+        {
+            memcpy(d->data, node.map.inline_data, node.size);
+        }
+        pthread_mutex_lock(&fs->alloc_lock);
+        fs->delayed_blocks += blocks - d->blocks;
+        pthread_mutex_unlock(&fs->alloc_lock);
+        d->blocks = blocks;
+    }
+    memcpy(d->data + (start - base), buf, length);
+    d->size = start + length > d->size ? start + length : d->size;
+}
+
+/**
+ * Drops the delayed writes of a file.
+ *
+ * @param uid The unique identifier of the inode.
+ */
+void drop_delayed_writes(sfs_t *fs, int uid)
+{
+    delayed_data *d = &fs->delayed[uid];
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->delayed_blocks -= d->blocks;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    free(d->data);
+    d->data = NULL;
+    d->blocks = 0;
+    d->capacity = 0;
+}
+
+/**
+ * Chooses blocks for the delayed writes of a file and writes them. Now that the final size is
+ * known, every delayed block is allocated at once, right after the last block of the file when
+ * the free space allows, so a file built from many small writes still ends up contiguous.
+ *
+ * @param uid The unique identifier of the inode.
+ * @return 0 if successful, -1 otherwise.
+ */
+int flush_delayed_writes(sfs_t *fs, int uid)
+{
+    delayed_data *d = &fs->delayed[uid];
+    if (d->blocks == 0)
+    {
+        return 0;
+    }
+    inode_s node = get_inode(fs, uid);
+    if (node.flags & INODE_INLINE)
+    { // the inline data is part of the delayed blocks
+        node.flags &= ~INODE_INLINE;
+        node.size = 0;
+        init_block_map(fs, &node);
+    }
+    int first = blocks_for(node.size, BLOCK_SIZE);
+    int goal = -1;
+    if (first > 0 && map_blocks(fs, node, first - 1, first, &goal) == -1)
+    {
+        goal = -1;
+    }
+    goal = goal == -1 ? -1 : goal + 1; // continue right after the last block of the file when possible
+    int blocks_written;
+    int reserved;
+    int *blocks = allocate_blocks(fs, node, d->blocks * BLOCK_SIZE, goal, &blocks_written, &reserved);
+    if (blocks == NULL)
+    {
+        return -1;
+    }
+    int status = store_blocks(fs, &node, first, first + d->blocks, blocks);
+    unreserve_blocks(fs, reserved);
+    block_vec *vec = malloc(d->blocks * sizeof(block_vec));
+    for (int i = 0; i < d->blocks; i++)
+    {
+        vec[i].address = blocks[i];
+        vec[i].buffer = d->data + (size_t)i * BLOCK_SIZE;
+    }
+    status = status == -1 || cache_writev(fs->cache, CACHE_DATA, vec, d->blocks) == -1 ? -1 : 0;
+    if (status == 0)
+    {
+        node.size = d->size;
+        update_inode(fs, node);
+        drop_delayed_writes(fs, uid);
+    }
+    else
+    { // the delayed data stays for a retry, which allocates afresh
+        if (trim_blocks(fs, &node, first, first + d->blocks, false) == 0 && first > 0)
+        { // an extent tree may have gained a level on the way, kept for the blocks that are left
+            update_inode(fs, node);
+        }
+        release_blocks(fs, blocks, blocks_written);
+    }
+    free(vec);
+    free(blocks);
+    return status;
+}
+
+/**
+ * Checks whether a write ending at the given byte can wait for its blocks. The blocks of every
+ * delayed write together have to fit the budget of the data cache and the free space.
+ *
+ * @param node The inode of the file.
+ * @param end The byte after the last one written.
+ * @return 1 if the part of the write past the allocated blocks can be delayed, 0 otherwise.
+ */
+int can_delay(sfs_t *fs, inode_s node, int end)
+{
+    long long base = allocated_bytes(fs, node);
+    long long growth = blocks_for(end - base, BLOCK_SIZE) - fs->delayed[node.uid].blocks;
+    growth = growth > 0 ? growth : 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    int fits = fs->delayed_blocks + growth <= fs->data_cache_bytes / BLOCK_SIZE && fs->delayed_blocks + growth <= get_blocks_available(fs);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return end > base && fits && blocks_for(end, BLOCK_SIZE) <= max_file_blocks(fs);
+}
+
+/**
+ * Chooses blocks for the delayed writes of every file and writes them. A writer making room
+ * already holds the lock of its own inode, so it skips the files other threads are using rather
+ * than wait for them while holding it.
+ *
+ * @param held The inode the caller holds the lock of exclusively, -1 for none.
+ * @return 0 if successful, -1 otherwise.
+ */
+int flush_all_delayed_writes(sfs_t *fs, int held)
+{
+    int status = 0;
+    for (int uid = 0; uid < fs->delayed_length; uid++)
+    {
+        if (uid != held && (held == -1 ? pthread_rwlock_wrlock(&fs->inode_locks[uid]) : pthread_rwlock_trywrlock(&fs->inode_locks[uid])) != 0)
+        {
+            continue;
+        }
+        if (flush_delayed_writes(fs, uid) == -1)
+        {
+            status = -1;
+        }
+        if (uid != held)
+        {
+            pthread_rwlock_unlock(&fs->inode_locks[uid]);
+        }
+    }
+    return status;
+}
+
+/**
+ * Moves the data of an inline file into a data block of its own so the file can grow past what
+ * the inode holds.
+ *
+ * @param node The inode of the file, updated in place.
+ * @return 0 if successful, -1 otherwise.
+ */
+int move_inline_data(sfs_t *fs, inode_s *node)
+{
+    inode_s moved = *node;
+    moved.flags &= ~INODE_INLINE;
+    moved.size = 0;
+    init_block_map(fs, &moved);
+    if (node->size == 0)
+    {
+        *node = moved;
+        return 0;
+    }
+    int blocks_written;
+    int reserved;
+    int *blocks = allocate_blocks(fs, moved, node->size, -1, &blocks_written, &reserved);
+    if (blocks == NULL)
+    {
+        return -1;
+    }
+    int status = store_blocks(fs, &moved, 0, 1, blocks);
+    unreserve_blocks(fs, reserved);
+    char *block = calloc(1, BLOCK_SIZE);
+    memcpy(block, node->map.inline_data, node->size);
+    status = status == -1 || cache_write(fs->cache, CACHE_DATA, blocks[0], block) == -1 ? -1 : 0;
+    if (status == -1)
+    {
+        release_blocks(fs, blocks, 1);
+    }
+    else
+    {
+        moved.size = node->size;
+        *node = moved;
+    }
+    free(block);
+    free(blocks);
+    return status;
+}
+
+/**
+ * Writes back the delayed writes, the metadata and the block cache of a file system.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int write_back(sfs_t *fs)
+{
+    int status = flush_all_delayed_writes(fs, -1);
+    status = flush_metadata(fs) == -1 ? -1 : status;
+    return cache_flush(fs->cache) == -1 ? -1 : status;
+}
+
+/**
+ * Writes back every mounted file system when the process exits, so a program that ends without
+ * syncing still leaves the data it wrote on disk.
+ */
+void flush_at_exit()
+{
+    pthread_mutex_lock(&mounted_lock);
+    for (sfs_t *fs = mounted; fs != NULL; fs = fs->next_mounted)
+    {
+        write_back(fs);
+    }
+    pthread_mutex_unlock(&mounted_lock);
+}
+
+/**
+ * Adds a file system to the list written back at exit, or takes it off the list.
+ *
+ * @param add 1 to add the file system, 0 to take it off.
+ */
+void list_mounted(sfs_t *fs, int add)
+{
+    pthread_mutex_lock(&mounted_lock);
+    sfs_t **link = &mounted;
+    while (*link != NULL && *link != fs)
+    {
+        link = &(*link)->next_mounted;
+    }
+    if (add && *link == NULL)
+    {
+        fs->next_mounted = NULL;
+        *link = fs;
+    }
+    else if (!add && *link != NULL)
+    {
+        *link = fs->next_mounted;
+    }
+    if (add && !flush_at_exit_registered)
+    {
+        atexit(flush_at_exit);
+        flush_at_exit_registered = true;
+    }
+    pthread_mutex_unlock(&mounted_lock);
+}
+
+/**
+ * Writes back what a mounted file system holds in memory, closes its disk and frees everything
+ * the mount set up. The settings and the locks of the handle stay, so it can be mounted again.
+ * Nothing else may run on the file system meanwhile.
+ *
+ * @return 0 if everything was written back, -1 otherwise.
+ */
+int unmount_fs(sfs_t *fs)
+{
+    list_mounted(fs, false);
+    int status = write_back(fs);
+    free_open_fd_table(fs);
+    free_delayed_writes(fs);
+    free_inode_locks(fs);
+    free(fs->inode_table.used);
+    fs->inode_table.used = NULL;
+    for (int i = 0; i < DIR_SHARDS; i++)
+    {
+        dir_hash_free(&fs->name_index[i]);
+    }
+    free(fs->free_extents.extents);
+    free(fs->free_extents.by_start);
+    free(fs->free_extents.by_end);
+    memset(&fs->free_extents, 0, sizeof(extent_index));
+    cache_free(fs->cache);
+    fs->cache = NULL;
+    free(fs->empty_block);
+    fs->empty_block = NULL;
+    free(fs->metadata_dirty);
+    fs->metadata_dirty = NULL;
+    if (fs->metadata_owned)
+    {
+        free(fs->metadata);
+    }
+    fs->metadata = NULL;
+    fs->metadata_owned = false;
+    disk_close(fs->disk);
+    memset(&fs->sb, 0, sizeof(super_block));
+    return status;
+}
+
+/**
+ * Syncs the disk when the periodic sync interval has elapsed since the last sync. Called without
+ * any inode lock held. Only one thread syncs, the others carry on.
+ */
+void sync_if_due(sfs_t *fs)
+{
+    if (fs->sync_interval > 0 && time(NULL) - fs->last_sync >= fs->sync_interval && pthread_mutex_trylock(&fs->sync_lock) == 0)
+    {
+        if (time(NULL) - fs->last_sync >= fs->sync_interval)
+        {
+            sfs_sync_r(fs);
+        }
+        pthread_mutex_unlock(&fs->sync_lock);
+    }
+}
+
+/**
+ * Frees a file: its inode, its delayed writes and its blocks. File descriptors still open on it
+ * fail until they are closed. The caller holds the inode lock exclusively.
+ *
+ * @param uid The unique identifier of the inode.
+ * @return 0 if successful, -1 if the inode is not in use.
+ */
+int free_file(sfs_t *fs, int uid)
+{
+    pthread_mutex_lock(&fs->alloc_lock);
+    inode_s node = remove_inode(fs, uid);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (node.uid == -1)
+    { // received default inode
+        return -1;
+    }
+    detach_open_inode(fs, node.uid);
+    drop_delayed_writes(fs, node.uid); // never written, so there is nothing to take back from the disk
+    int counter;
+    int *blocks_to_be_released = get_blocks(fs, node, &counter);
+    release_blocks(fs, blocks_to_be_released, counter);
+    free(blocks_to_be_released);
+    return 0;
+}
+
+/**
+ * Frees the files that were unlinked but never released, as happens when the process holding
+ * them open ends without unmounting.
+ */
+void reclaim_unlinked(sfs_t *fs)
+{
+    int reclaimed = 0;
+    for (int uid = 0; uid < MAX_DIRECTORIES; uid++)
+    {
+        if (fs->inode_table.inodes[uid].uid == uid && fs->inode_table.inodes[uid].flags & INODE_UNLINKED)
+        {
+            reclaimed |= free_file(fs, uid) == 0;
+        }
+    }
+    if (reclaimed)
+    {
+        flush_metadata(fs);
+    }
+}
+
+//------------------------------- Api Methods -------------------------------//
+
+/**
+ * Mounts the file system of an image on a handle, after unmounting the one it had. An existing
+ * file system keeps the geometry recorded in its super block, the given one is only used when a
+ * new file system is created. Without fresh, one is only created in an image that is missing or
+ * empty: an image that cannot be read as this version of the file system fails the mount.
+ *
+ * @param path The disk image.
+ * @param fresh Determing if new file system or open existing
+ * @param geometry Block size, number of blocks and number of inodes of a new file system
+ * @return 0 if succesful -1 otherwise
+ */
+int mount_fs(sfs_t *fs, char *path, int fresh, const sfs_geometry *geometry)
+{
+    super_block planned;
+    if (init_layout(&planned, geometry) == -1)
+    {
+        print("Invalid file system geometry.");
+        return -1;
+    }
+    srand((unsigned int)(time(0))); // random number generator
+    if (BLOCK_SIZE > 0)
+    { // write back what the disk being closed still holds in memory
+        unmount_fs(fs);
+    }
+    disk_close(fs->disk);
+    if (!fresh && !image_is_blank(path) && mount_disk(fs, path) == -1)
+    { // whatever the image holds stays as it is
+        disk_close(fs->disk);
+        return -1;
+    }
+    if (fresh || image_is_blank(path))
+    {
+        if (disk_init_fresh(fs->disk, path, planned.block_size, planned.file_system_size, fs->disk_mode) == -1)
+        {
+            return -1;
+        }
+        format_metadata(fs, &planned);
+    }
+    init_empty_block(fs);
+    init_block_cache(fs);
+    load_free_bit_map(fs);
+    init_free_extents(fs);
+    init_inode_table(fs);
+    init_inode_locks(fs);
+    init_delayed_writes(fs);
+    init_open_fd_table(fs);
+    init_dir_cache(fs);
+    reclaim_unlinked(fs);
+    list_mounted(fs, true);
+    return 0;
+}
+
+/**
+ * Fills in the settings of a mount that opens the file system already in the image, or creates
+ * one with the default geometry if there is none, with the default cache budgets.
+ *
+ * @param opts The settings to fill in.
+ */
+void sfs_default_options(sfs_options *opts)
+{
+    memset(opts, 0, sizeof(sfs_options));
+    opts->geometry = default_geometry;
+    opts->data_cache_bytes = DEFAULT_DATA_CACHE;
+    opts->metadata_cache_bytes = DEFAULT_METADATA_CACHE;
+    opts->disk_mode = DISK_MODE_PIO;
+}
+
+/**
+ * Mounts the file system of an image on a handle of its own. Every handle has its own disk,
+ * block cache, allocator and file descriptors, so one process can hold many file systems.
+ *
+ * @param path The disk image.
+ * @param opts How to mount the file system, NULL for the defaults of sfs_default_options.
+ * @return The handle of the file system, NULL if it could not be mounted.
+ */
+sfs_t *sfs_mount(char *path, const sfs_options *opts)
+{
+    sfs_options defaults;
+    if (opts == NULL)
+    {
+        sfs_default_options(&defaults);
+        opts = &defaults;
+    }
+    if (opts->data_cache_bytes < 0 || opts->metadata_cache_bytes < 0)
+    {
+        print("Invalid cache budget.");
+        return NULL;
+    }
+    if (opts->disk_mode != DISK_MODE_PIO && opts->disk_mode != DISK_MODE_MMAP)
+    { // the stdio mode shares one seek pointer, so it cannot serve concurrent callers
+        print("Invalid disk mode.");
+        return NULL;
+    }
+    disk_t *disk = disk_new();
+    sfs_t *fs = disk == NULL ? NULL : new_context(disk);
+    if (fs == NULL)
+    {
+        disk_free(disk);
+        return NULL;
+    }
+    fs->data_cache_bytes = opts->data_cache_bytes;
+    fs->metadata_cache_bytes = opts->metadata_cache_bytes;
+    fs->discard_freed = opts->discard;
+    fs->disk_mode = opts->disk_mode;
+    if (mount_fs(fs, path, opts->fresh, &opts->geometry) == -1)
+    {
+        free_context(fs);
+        return NULL;
+    }
+    sfs_set_sync_interval_r(fs, opts->sync_interval);
+    return fs;
+}
+
+/**
+ * Makes everything written to a file system durable, closes its image and frees its handle. The
+ * handle must not be in use by any other thread.
+ *
+ * @param fs The file system.
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_unmount(sfs_t *fs)
+{
+    if (fs == NULL)
+    {
+        return -1;
+    }
+    int status = sfs_sync_r(fs);
+    if (unmount_fs(fs) == -1)
+    {
+        status = -1;
+    }
+    free_context(fs);
+    return status;
+}
+
+/**
+ * Reads the next file to the fname input variable. Once every file has been listed the
+ * listing starts over from the first file.
+ *
+ * @param fs The file system.
+ * @param fname Variable to read to.
+ * @return 0 if not more files 1 otherwise
+ */
+int sfs_getnextfilename_r(sfs_t *fs, char *fname)
+{
+    pthread_mutex_lock(&fs->dir_lock);
+    for (; fs->dir_index < MAX_DIRECTORIES; fs->dir_index++)
+    {
+        dir_e entry = fs->dir_cache[fs->dir_index];
+        if (entry.inode != -1)
+        {
+            strcpy(fname, entry.filename);
+            fs->dir_index++;
+            pthread_mutex_unlock(&fs->dir_lock);
+            return 1;
+        }
+    }
+    fs->dir_index = 0; // if gets to here no more entries
+    pthread_mutex_unlock(&fs->dir_lock);
+    return 0;
+}
+
+/**
+ * Retrieves the size of a file in the system if it exists.
+ *
+ * @param fs The file system.
+ * @param path Path of the file
+ * @return Length of the file if found -1 otherwise
+ */
+int sfs_getfilesize_r(sfs_t *fs, const char *path)
+{
+    pthread_rwlock_t *name_lock = &fs->name_locks[name_shard(path)];
+    pthread_rwlock_rdlock(name_lock);
+    dir_e entry = get_dir_entry(fs, (char *)path);
+    if (entry.inode == -1)
+    {
+        pthread_rwlock_unlock(name_lock);
+        print("File not found");
+        return -1;
+    }
+    pthread_rwlock_rdlock(&fs->inode_locks[entry.inode]);
+    int size = file_size(fs, get_inode(fs, entry.inode));
+    pthread_rwlock_unlock(&fs->inode_locks[entry.inode]);
+    pthread_rwlock_unlock(name_lock);
+    return size;
+}
+
+/**
+ * Finds the inode number of a file. Inode numbers stay the same for as long as the file exists,
+ * so callers can keep them instead of looking the name up again.
+ *
+ * @param fs The file system.
+ * @param name Name of the file
+ * @return Inode number of the file if found -1 otherwise
+ */
+int sfs_lookup_r(sfs_t *fs, const char *name)
+{
+    pthread_rwlock_t *name_lock = &fs->name_locks[name_shard(name)];
+    pthread_rwlock_rdlock(name_lock);
+    dir_e entry = get_dir_entry(fs, (char *)name);
+    pthread_rwlock_unlock(name_lock);
+    return entry.inode;
+}
+
+/**
+ * Retrieves the size of a file from its inode number, without a name lookup.
+ *
+ * @param fs The file system.
+ * @param inode Inode number of the file
+ * @return Length of the file if found -1 otherwise
+ */
+int sfs_getinodesize_r(sfs_t *fs, int inode)
+{
+    if (inode < 0 || inode >= MAX_DIRECTORIES)
+    {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&fs->inode_locks[inode]);
+    inode_s node = get_numbered_inode(fs, inode);
+    int size = node.uid == -1 ? -1 : file_size(fs, node);
+    pthread_rwlock_unlock(&fs->inode_locks[inode]);
+    return size;
+}
+
+/**
+ * Reads the next file of the directory at or after a position. Unlike sfs_getnextfilename the
+ * position belongs to the caller, so several listings can run at once and a listing can carry
+ * on where it left off. Files created or removed meanwhile do not move the others.
+ *
+ * @param fs The file system.
+ * @param position Where to start, 0 for the first file, moved past the file read
+ * @param fname Variable to read to.
+ * @return Inode number of the file read, -1 when there are no more files
+ */
+int sfs_getnextdirent_r(sfs_t *fs, int *position, char *fname)
+{
+    pthread_mutex_lock(&fs->dir_lock);
+    for (; *position < MAX_DIRECTORIES; (*position)++)
+    {
+        dir_e entry = fs->dir_cache[*position];
+        if (entry.inode != -1)
+        {
+            strcpy(fname, entry.filename);
+            (*position)++;
+            pthread_mutex_unlock(&fs->dir_lock);
+            return entry.inode;
+        }
+    }
+    pthread_mutex_unlock(&fs->dir_lock);
+    return -1;
+}
+
+/**
+ * Opens a file, creating it first if it does not exist yet. The lock of the shard its name is in
+ * is held throughout, so whether the file exists cannot change before it is opened or created.
+ *
+ * @param name Name of the file to open
+ * @param exclusive Whether a file that exists already makes the call fail rather than being opened
+ * @return The file descriptor of the file or -1 if unsuccessful
+ */
+int open_file(sfs_t *fs, char *name, int exclusive)
+{
+    int fd;
+    pthread_rwlock_t *name_lock = &fs->name_locks[name_shard(name)];
+    pthread_rwlock_wrlock(name_lock); // nobody else creates or removes the file meanwhile
+    dir_e entry = get_dir_entry(fs, name);
+    if (entry.inode != -1 && exclusive)
+    {
+        pthread_rwlock_unlock(name_lock);
+        print("File already exists");
+        return -1;
+    }
+    if (entry.inode != -1)
+    { // already on disk
+        pthread_rwlock_rdlock(&fs->inode_locks[entry.inode]); // writers on other descriptors update the inode
+        fd = create_fd_entry(fs, get_inode(fs, entry.inode));
+        pthread_rwlock_unlock(&fs->inode_locks[entry.inode]);
+        pthread_rwlock_unlock(name_lock);
+        return fd;
+    }
+    pthread_mutex_lock(&fs->alloc_lock);
+    inode_s new_node = init_inode(fs);
+    if (new_node.uid == -1)
+    { // default inode
+        pthread_mutex_unlock(&fs->alloc_lock);
+        pthread_rwlock_unlock(name_lock);
+        print("Probleming initializing inode.");
+        return -1;
+    }
+    new_node.size = 0; // file size
+    int created = create_file(fs, name, new_node) != -1 && create_inode_entry(fs, new_node) != -1;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (!created || (fd = create_fd_entry(fs, new_node)) == -1)
+    {
+        pthread_rwlock_unlock(name_lock);
+        print("SFS Failed to open file.");
+        return -1;
+    }
+    pthread_rwlock_unlock(name_lock);
+    flush_metadata(fs);
+    return fd;
+}
+
+/**
+ * Opens the file, creating it in the file system first if it does not exist yet, and sets its
+ * read and write pointer.
+ *
+ * @param fs The file system.
+ * @param name Name of the file to open
+ * @return The file descriptor of the file or -1 if unsuccessful
+ */
+int sfs_fopen_r(sfs_t *fs, char *name)
+{
+    return open_file(fs, name, false);
+}
+
+/**
+ * Creates the file and opens it, failing if a file with that name exists already.
+ *
+ * @param fs The file system.
+ * @param name Name of the file to create
+ * @return The file descriptor of the file or -1 if it exists or cannot be created
+ */
+int sfs_fcreate_r(sfs_t *fs, char *name)
+{
+    return open_file(fs, name, true);
+}
+
+/**
+ * Opens an existing file from its inode number, without a name lookup.
+ *
+ * @param fs The file system.
+ * @param inode Inode number of the file
+ * @return Id of the file if succesful -1 otherwise
+ */
+int sfs_iopen_r(sfs_t *fs, int inode)
+{
+    if (inode < 0 || inode >= MAX_DIRECTORIES)
+    {
+        print("File not found");
+        return -1;
+    }
+    pthread_rwlock_rdlock(&fs->inode_locks[inode]); // the file is not removed meanwhile
+    inode_s node = get_numbered_inode(fs, inode);
+    int fd = node.uid == -1 ? -1 : create_fd_entry(fs, node);
+    pthread_rwlock_unlock(&fs->inode_locks[inode]);
+    if (node.uid == -1)
+    {
+        print("File not found");
+    }
+    return fd;
+}
+
+/**
+ * Retrieves the inode number of an open file.
+ *
+ * @param fs The file system.
+ * @param fileID Id of the file
+ * @return Inode number of the file, -1 if it is not open or was removed
+ */
+int sfs_fileno_r(sfs_t *fs, int fileID)
+{
+    fdt_entry *entry = get_open_file(fs, fileID);
+    return entry == NULL ? -1 : entry->file->uid;
+}
+
+/**
+ * "Closes" the file by removing the entry from the FD table.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_fclose_r(sfs_t *fs, int fileID)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    int status = 0;
+    if (entry != NULL)
+    {
+        open_inode *file = entry->file;
+        pthread_rwlock_wrlock(&fs->inode_locks[file->uid]);
+        status = file->inode != NULL ? flush_delayed_writes(fs, file->uid) : 0;
+        pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    }
+    if (status == -1)
+    {
+        print("Was unable to write the delayed blocks of the file");
+        delete_fd_entry(fs, fileID);
+        return -1;
+    }
+    flush_metadata(fs);
+    return delete_fd_entry(fs, fileID);
+}
+
+/**
+ * Writes bytes into the blocks a file has, allocating the blocks the write goes past the end of
+ * the file with. A gap between the end of the file and start reads as zeros.
+ *
+ * @param file The open inode, its block map is extended in place.
+ * @param inode The inode of the file, not inline, updated in place.
+ * @param start First byte to write.
+ * @param buf The bytes to write.
+ * @param length Number of bytes to write, at least 1.
+ * @return 0 if successful, -1 otherwise.
+ */
+int write_allocated(sfs_t *fs, open_inode *file, inode_s *inode, int start, const char *buf, int length)
+{
+    int size = start + length > inode->size ? start + length : inode->size;
+    int old_blocks = blocks_for(inode->size, BLOCK_SIZE);
+    int new_blocks = blocks_for(size, BLOCK_SIZE);
+    int *map = file_block_map(fs, file, *inode, old_blocks);
+    if (map == NULL)
+    {
+        print("Was unable to read the block map of the file");
+        return -1;
+    }
+    if (new_blocks > old_blocks)
+    { // only the blocks past the end of the file are new, the rest are overwritten in place
+        int blocks_written;
+        int reserved;
+        int goal = old_blocks > 0 ? map[old_blocks - 1] + 1 : -1; // continue right after the last block of the file when possible
+        int *blocks = allocate_blocks(fs, *inode, (new_blocks - old_blocks) * BLOCK_SIZE, goal, &blocks_written, &reserved);
+        if (blocks == NULL)
+        {
+            print("Was unable to allocate blocks for file write");
+            return -1;
+        }
+        inode_s stored = *inode;
+        int status = store_blocks(fs, &stored, old_blocks, new_blocks, blocks);
+        unreserve_blocks(fs, reserved);
+        if (status == -1)
+        {
+            print("Was unable to update the index blocks of the file");
+            if (trim_blocks(fs, &stored, old_blocks, new_blocks, false) == 0)
+            { // an extent tree may have gained a level on the way, kept for the blocks that are left
+                *inode = stored;
+            }
+            release_blocks(fs, blocks, blocks_written);
+            free(blocks);
+            return -1;
+        }
+        *inode = stored;
+        reserve_block_map(file, new_blocks);
+        memcpy(file->block_map + old_blocks, blocks, blocks_written * sizeof(int)); // known already, no need to look them up
+        file->mapped = new_blocks;
+        free(blocks);
+    }
+    int status = write_file_range(fs, file->block_map, old_blocks, start, buf, length);
+    inode->size = size;
+    return status;
+}
+
+/**
+ * Writes bytes into a file at the given position, growing the file if the write goes past its
+ * end. A gap between the end of the file and the position reads as zeros. Bytes past the blocks
+ * the file has are kept in memory and only get blocks when the file is closed or synced, or when
+ * the delayed writes outgrow the data cache budget. The caller holds the inode lock exclusively.
+ *
+ * @param file The open inode of the file.
+ * @param buf Buffer to write from
+ * @param length Length to write, at least 1
+ * @param start Position in the file to write at
+ * @return Number of bytes written if succesful -1 otherwise
+ */
+int write_at(sfs_t *fs, open_inode *file, const char *buf, int length, int start)
+{
+    inode_s inode = *file->inode;
+    if ((long long)start + length > INT32_MAX)
+    {
+        print("File would grow past the maximum file size.");
+        return -1;
+    }
+    int end = start + length;
+    int size = end > file_size(fs, inode) ? end : file_size(fs, inode);
+    if (inode.flags & INODE_INLINE && fs->delayed[inode.uid].blocks == 0 && size <= inline_capacity(fs))
+    { // still small enough to live in the inode, no data block needed
+        if (start > inode.size)
+        {
+            memset(inode.map.inline_data + inode.size, 0, start - inode.size);
+        }
+        memcpy(inode.map.inline_data + start, buf, length);
+        inode.size = size;
+        update_inode(fs, inode);
+        return length;
+    }
+    long long base = allocated_bytes(fs, inode);
+    if (end > base && !can_delay(fs, inode, end) && fs->delayed_blocks > 0 && flush_all_delayed_writes(fs, inode.uid) != -1)
+    { // make room for this write by placing the others
+        inode = get_inode(fs, inode.uid);
+        base = allocated_bytes(fs, inode);
+    }
+    int status = 0;
+    if (can_delay(fs, inode, end))
+    { // the blocks past the end of the file are chosen once its final size is known
+        if (start < base)
+        {
+            status = write_allocated(fs, file, &inode, start, buf, base - start);
+        }
+        int from = start > base ? start : base;
+        if (status == 0)
+        {
+            delay_write(fs, inode, from, buf + (from - start), end - from);
+        }
+    }
+    else
+    {
+        if (end > base && flush_delayed_writes(fs, inode.uid) == -1)
+        {
+            print("Was unable to write the delayed blocks of the file");
+            return -1;
+        }
+        inode = get_inode(fs, inode.uid);
+        if (inode.flags & INODE_INLINE && move_inline_data(fs, &inode) == -1)
+        {
+            print("Was unable to move inline data into a block");
+            return -1;
+        }
+        status = write_allocated(fs, file, &inode, start, buf, length);
+    }
+    if (memcmp(&inode, &fs->inode_table.inodes[inode.uid], sizeof(inode_s)) != 0)
+    { // a write that only went into delayed blocks leaves the inode as it was
+        update_inode(fs, inode);
+    }
+    if (status == -1)
+    {
+        print("Was unable to write file blocks");
+        return -1;
+    }
+    return length;
+}
+
+/**
+ * Reads bytes of a file into the buffer provided, starting at the given position and stopping at
+ * the end of the file. The caller holds the inode lock, readers of the same file share it.
+ *
+ * @param entry The open file, its read-ahead state is updated.
+ * @param buf Buffer to read into
+ * @param length Length to read
+ * @param start Position in the file to read from
+ * @return Number of bytes read if succesful -1 otherwise
+ */
+int read_at(sfs_t *fs, fdt_entry *entry, char *buf, int length, int start)
+{
+    open_inode *file = entry->file;
+    inode_s inode = *file->inode;
+    int bytes = file_size(fs, inode) - start;
+    if (bytes > length)
+    {
+        bytes = length;
+    }
+    if (bytes <= 0)
+    {
+        return 0;
+    }
+    long long base = allocated_bytes(fs, inode);
+    int on_disk = start < base ? (start + bytes < base ? bytes : base - start) : 0;
+    if (inode.flags & INODE_INLINE && fs->delayed[inode.uid].blocks == 0)
+    { // served straight from the inode table
+        memcpy(buf, inode.map.inline_data + start, bytes);
+    }
+    else if (on_disk > 0)
+    {
+        int first = start / BLOCK_SIZE;
+        int last = (start + on_disk - 1) / BLOCK_SIZE;
+        int *blocks = malloc((last - first + 1) * sizeof(int));
+        if (blocks == NULL)
+        {
+            print("Was unable to allocate the block list");
+            return -1;
+        }
+        pthread_mutex_lock(&file->lock);
+        int *map = file_block_map(fs, file, inode, last + 1);
+        if (map != NULL)
+        { // other readers may grow the map once the lock is released
+            memcpy(blocks, map + first, (last - first + 1) * sizeof(int));
+        }
+        pthread_mutex_unlock(&file->lock);
+        int status = map == NULL || read_file_range(fs, blocks, start - first * BLOCK_SIZE, buf, on_disk) == -1 ? -1 : 0;
+        free(blocks);
+        if (status == -1)
+        {
+            print("Was unable to read file blocks");
+            return -1;
+        }
+        pthread_mutex_lock(&file->lock);
+        read_ahead(fs, entry, inode, first, last);
+        pthread_mutex_unlock(&file->lock);
+    }
+    if (on_disk < bytes && fs->delayed[inode.uid].blocks > 0)
+    { // the rest has no blocks yet
+        long long from = start + on_disk;
+        memcpy(buf + on_disk, fs->delayed[inode.uid].data + (from - base), bytes - on_disk);
+    }
+    return bytes;
+}
+
+/**
+ * Writes into an open file at the given position under the exclusive lock of its inode.
+ *
+ * @param entry The open file.
+ * @param buf Buffer to write from
+ * @param length Length to write
+ * @param start Position in the file to write at
+ * @return Number of bytes written if succesful -1 otherwise
+ */
+int locked_write(sfs_t *fs, fdt_entry *entry, const char *buf, int length, int start)
+{
+    if (length <= 0)
+    {
+        return length == 0 ? 0 : -1;
+    }
+    open_inode *file = entry->file;
+    pthread_rwlock_wrlock(&fs->inode_locks[file->uid]);
+    int written = -1;
+    if (file->inode == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+    }
+    else
+    {
+        written = write_at(fs, file, buf, length, start);
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    flush_metadata(fs);
+    sync_if_due(fs);
+    return written;
+}
+
+/**
+ * Reads from an open file at the given position under the shared lock of its inode.
+ *
+ * @param entry The open file.
+ * @param buf Buffer to read into
+ * @param length Length to read
+ * @param start Position in the file to read from
+ * @return Number of bytes read if succesful -1 otherwise
+ */
+int locked_read(sfs_t *fs, fdt_entry *entry, char *buf, int length, int start)
+{
+    open_inode *file = entry->file;
+    pthread_rwlock_rdlock(&fs->inode_locks[file->uid]);
+    int bytes = -1;
+    if (file->inode == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+    }
+    else
+    {
+        bytes = read_at(fs, entry, buf, length, start);
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    return bytes;
+}
+
+/**
+ * Finds where bytes [start, start + length) of a file lie in the image, as one extent per run of
+ * adjacent blocks. Cached copies newer than the image are written back first so the image holds
+ * the latest contents, and dropped when the extents are about to be written. The caller holds
+ * the inode lock, exclusively to write, and every byte of the range has a block.
+ *
+ * @param file The open file.
+ * @param node The inode of the file.
+ * @param start First byte of the range.
+ * @param length Number of bytes in the range, at least 1.
+ * @param write Whether the extents are about to be written.
+ * @param extents Where the extents go, with room for one per block of the range.
+ * @return Number of extents, -1 if the image cannot be reached directly, a block is not mapped or
+ * memory runs out.
+ */
+int locate_file_range(sfs_t *fs, open_inode *file, inode_s node, int start, int length, int write, sfs_extent *extents)
+{
+    int first = start / BLOCK_SIZE;
+    int last = (start + length - 1) / BLOCK_SIZE;
+    int *blocks = malloc((last - first + 1) * sizeof(int));
+    if (blocks == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&file->lock);
+    int *map = file_block_map(fs, file, node, last + 1);
+    if (map != NULL)
+    { // other readers may grow the map once the lock is released
+        memcpy(blocks, map + first, (last - first + 1) * sizeof(int));
+    }
+    pthread_mutex_unlock(&file->lock);
+    int count = map == NULL ? -1 : 0;
+    for (int b = first; b <= last && count != -1;)
+    {
+        int run = 1;
+        while (b + run <= last && blocks[b + run - first] == blocks[b - first] + run)
+        {
+            run++;
+        }
+        int lo, hi, end_lo, end_hi;
+        block_span(fs, b, start, length, &lo, &hi);
+        block_span(fs, b + run - 1, start, length, &end_lo, &end_hi);
+        sfs_extent *extent = &extents[count];
+        if (cache_write_back(fs->cache, blocks + (b - first), run) == -1 || disk_locate_blocks(fs->disk, blocks[b - first], run, write, &extent->fd, &extent->pos) == -1)
+        {
+            count = -1;
+            break;
+        }
+        for (int i = 0; i < run && write; i++)
+        { // the image is about to change under them
+            cache_discard(fs->cache, blocks[b - first + i]);
+        }
+        extent->mem = NULL;
+        extent->pos += lo;
+        extent->length = (run - 1) * BLOCK_SIZE + end_hi - lo;
+        count++;
+        b += run;
+    }
+    free(blocks);
+    return count;
+}
+
+/**
+ * Hands the bytes of a file from the given position to a mover as extents, stopping at the end
+ * of the file. Bytes with blocks are located in the image, the others are handed over where they
+ * sit in memory. The caller holds the inode lock, readers of the same file share it.
+ *
+ * @param entry The open file.
+ * @param length Length to read
+ * @param start Position in the file to read from
+ * @param move Moves the bytes, called once, with no extents past the end of the file.
+ * @param arg Passed to move.
+ * @return What move returns, -1 if the bytes could not be located
+ */
+int read_extents_at(sfs_t *fs, fdt_entry *entry, int length, int start, sfs_extent_fn move, void *arg)
+{
+    open_inode *file = entry->file;
+    inode_s inode = *file->inode;
+    int bytes = file_size(fs, inode) - start;
+    if (bytes > length)
+    {
+        bytes = length;
+    }
+    if (bytes <= 0)
+    {
+        return move(arg, NULL, 0);
+    }
+    long long base = allocated_bytes(fs, inode);
+    int on_disk = start < base ? (start + bytes < base ? bytes : base - start) : 0;
+    if (inode.flags & INODE_INLINE && fs->delayed[inode.uid].blocks == 0)
+    { // straight from the inode table
+        sfs_extent extent = {inode.map.inline_data + start, -1, 0, bytes};
+        return move(arg, &extent, 1);
+    }
+    int blocks = on_disk > 0 ? (start + on_disk - 1) / BLOCK_SIZE - start / BLOCK_SIZE + 1 : 0;
+    sfs_extent *extents = malloc((blocks + 1) * sizeof(sfs_extent)); // a run per block at most, then the delayed bytes
+    int count = extents == NULL ? -1 : on_disk > 0 ? locate_file_range(fs, file, inode, start, on_disk, 0, extents) : 0;
+    int moved = -1;
+    if (count == -1)
+    { // through a buffer instead
+        sfs_extent extent = {malloc(bytes), -1, 0, bytes};
+        if (extent.mem != NULL && read_at(fs, entry, extent.mem, bytes, start) == bytes)
+        {
+            moved = move(arg, &extent, 1);
+        }
+        free(extent.mem);
+        free(extents);
+        return moved;
+    }
+    if (on_disk < bytes && fs->delayed[inode.uid].blocks > 0)
+    { // the rest has no blocks yet
+        long long from = start + on_disk;
+        extents[count].mem = fs->delayed[inode.uid].data + (from - base);
+        extents[count].fd = -1;
+        extents[count].pos = 0;
+        extents[count].length = bytes - on_disk;
+        count++;
+    }
+    moved = move(arg, extents, count);
+    free(extents);
+    return moved;
+}
+
+/**
+ * Hands bytes of a file from the given position to a mover as extents of the image to write in
+ * place. Only bytes that already have blocks, below the size of the file, are written this way,
+ * as a write that needs new blocks or grows the file has to go through write_at. The caller
+ * holds the exclusive inode lock.
+ *
+ * @param file The open file.
+ * @param length Length to write, at least 1
+ * @param start Position in the file to write at
+ * @param move Moves the bytes into the extents.
+ * @param arg Passed to move.
+ * @return What move returns, 0 if the range cannot be written in place, -1 on error
+ */
+int write_extents_at(sfs_t *fs, open_inode *file, int length, int start, sfs_extent_fn move, void *arg)
+{
+    inode_s inode = *file->inode;
+    if (inode.flags & INODE_INLINE || (long long)start + length > inode.size)
+    {
+        return 0;
+    }
+    int blocks = (start + length - 1) / BLOCK_SIZE - start / BLOCK_SIZE + 1;
+    sfs_extent *extents = malloc(blocks * sizeof(sfs_extent));
+    int count = extents == NULL ? -1 : locate_file_range(fs, file, inode, start, length, 1, extents);
+    int moved = count == -1 ? 0 : move(arg, extents, count);
+    free(extents);
+    return moved;
+}
+
+/**
+ * Writes the buffer provided into a file at its read and write pointer, growing the file if the
+ * write goes past its end. A gap between the end of the file and the pointer reads as zeros.
+ * Bytes past the blocks the file has are kept in memory and only get blocks when the file is
+ * closed or synced, or when the delayed writes outgrow the data cache budget.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @param buf Buffer to write from
+ * @param length Length to write
+ * @return Number of bytes written if succesful -1 otherwise
+ */
+int sfs_fwrite_r(sfs_t *fs, int fileID, const char *buf, int length)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    int written = locked_write(fs, entry, buf, length, entry->offset);
+    if (written > 0)
+    {
+        entry->offset += written;
+    }
+    return written;
+}
+
+/**
+ * Writes the buffer provided into a file at the given position, leaving its read and write
+ * pointer where it is. Threads can share a file descriptor this way.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @param buf Buffer to write from
+ * @param length Length to write
+ * @param loc Position in the file to write at
+ * @return Number of bytes written if succesful -1 otherwise
+ */
+int sfs_pwrite_r(sfs_t *fs, int fileID, const char *buf, int length, int loc)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    if (loc < 0)
+    {
+        print("Cannot write before the start of the file");
+        return -1;
+    }
+    return locked_write(fs, entry, buf, length, loc);
+}
+
+/**
+ * Reads the some or all of the contents of a file into the buffer provided, starting at its read
+ * and write pointer and stopping at the end of the file.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @param buf Buffer to read into
+ * @param length Length to read
+ * @return Number of bytes read if succesful -1 otherwise
+ */
+int sfs_fread_r(sfs_t *fs, int fileID, char *buf, int length)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    int bytes = locked_read(fs, entry, buf, length, entry->offset);
+    if (bytes > 0)
+    {
+        entry->offset += bytes;
+    }
+    return bytes;
+}
+
+/**
+ * Reads some or all of the contents of a file into the buffer provided, starting at the given
+ * position and leaving the read and write pointer where it is. Threads can share a file
+ * descriptor this way.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @param buf Buffer to read into
+ * @param length Length to read
+ * @param loc Position in the file to read from
+ * @return Number of bytes read if succesful -1 otherwise
+ */
+int sfs_pread_r(sfs_t *fs, int fileID, char *buf, int length, int loc)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    if (loc < 0)
+    {
+        print("Cannot read before the start of the file");
+        return -1;
+    }
+    return locked_read(fs, entry, buf, length, loc);
+}
+
+/**
+ * Reads some or all of the contents of a file from the given position without copying them out.
+ * The bytes are handed to a mover as extents, located in the disk image where they have blocks,
+ * so it can splice them elsewhere. The file stays locked until the mover returns.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @param length Length to read
+ * @param loc Position in the file to read from
+ * @param move Moves the bytes, called once, with no extents past the end of the file.
+ * @param arg Passed to move.
+ * @return What move returns if succesful -1 otherwise
+ */
+int sfs_pread_extents_r(sfs_t *fs, int fileID, int length, int loc, sfs_extent_fn move, void *arg)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    if (loc < 0)
+    {
+        print("Cannot read before the start of the file");
+        return -1;
+    }
+    open_inode *file = entry->file;
+    pthread_rwlock_rdlock(&fs->inode_locks[file->uid]);
+    int moved = -1;
+    if (file->inode == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+    }
+    else
+    {
+        moved = read_extents_at(fs, entry, length, loc, move, arg);
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    return moved;
+}
+
+/**
+ * Writes over bytes of a file in place in the disk image, without a buffer. The mover is handed
+ * the extents of the image the bytes go to, so it can splice them in. Only bytes that already
+ * have blocks, below the size of the file, are written this way, anything else is left to
+ * sfs_pwrite. The file stays locked until the mover returns.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @param length Length to write
+ * @param loc Position in the file to write at
+ * @param move Moves the bytes into the extents.
+ * @param arg Passed to move.
+ * @return What move returns, 0 if the range cannot be written in place, -1 otherwise
+ */
+int sfs_pwrite_extents_r(sfs_t *fs, int fileID, int length, int loc, sfs_extent_fn move, void *arg)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    if (loc < 0)
+    {
+        print("Cannot write before the start of the file");
+        return -1;
+    }
+    if (length <= 0)
+    {
+        return length == 0 ? 0 : -1;
+    }
+    open_inode *file = entry->file;
+    pthread_rwlock_wrlock(&fs->inode_locks[file->uid]);
+    int moved = -1;
+    if (file->inode == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+    }
+    else
+    {
+        moved = write_extents_at(fs, file, length, loc, move, arg);
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    sync_if_due(fs);
+    return moved;
+}
+
+/**
+ * Sets the read and right pointer for a given file.
+ *
+ * @param fs The file system.
+ * @param fileId Id of the file
+ * @param loc New desired pointer location, in bytes from the start of the file.
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_fseek_r(sfs_t *fs, int fileId, int loc)
+{
+    fdt_entry *entry = get_open_file(fs, fileId);
+    if (entry == NULL)
+    {
+        print("INode with fileId not found");
+        return -1;
+    }
+    if (loc < 0)
+    {
+        print("Cannot seek before the start of the file");
+        return -1;
+    }
+    if (loc != entry->offset)
+    { // a sequential reader starts over
+        pthread_mutex_lock(&entry->file->lock);
+        entry->readahead = 0;
+        entry->prefetched = 0;
+        pthread_mutex_unlock(&entry->file->lock);
+    }
+    entry->offset = loc;
+    return 0;
+}
+
+/**
+ * Removes a file from the file system and reclaims any resources that file may have been using.
+ *
+ * @param fs The file system.
+ * @param Name of the file
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_remove_r(sfs_t *fs, char *file)
+{
+    pthread_rwlock_t *name_lock = &fs->name_locks[name_shard(file)];
+    pthread_rwlock_wrlock(name_lock);
+    dir_e entry = get_dir_entry(fs, file);
+    if (entry.inode == -1)
+    { // received default
+        pthread_rwlock_unlock(name_lock);
+        print("File set for removal not found");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->inode_locks[entry.inode]); // waits for the reads and writes under way
+    if (free_file(fs, entry.inode) == -1)
+    {
+        pthread_rwlock_unlock(&fs->inode_locks[entry.inode]);
+        pthread_rwlock_unlock(name_lock);
+        print("Unable to delete inode");
+        return -1;
+    }
+    remove_mapping(fs, entry);
+    pthread_rwlock_unlock(&fs->inode_locks[entry.inode]);
+    pthread_rwlock_unlock(name_lock);
+    flush_metadata(fs);
+    return 0;
+}
+
+/**
+ * Removes the name of a file, leaving the file itself to whoever still uses it. It stays
+ * reachable by its inode number and through the file descriptors open on it until
+ * sfs_iremove_r frees it, or until the next mount if it never is.
+ *
+ * @param fs The file system.
+ * @param file Name of the file
+ * @return Inode number of the file if succesful -1 otherwise
+ */
+int sfs_unlink_r(sfs_t *fs, char *file)
+{
+    pthread_rwlock_t *name_lock = &fs->name_locks[name_shard(file)];
+    pthread_rwlock_wrlock(name_lock);
+    dir_e entry = get_dir_entry(fs, file);
+    if (entry.inode == -1)
+    { // received default
+        pthread_rwlock_unlock(name_lock);
+        print("File set for removal not found");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->inode_locks[entry.inode]); // writers on other descriptors update the inode
+    inode_s node = get_inode(fs, entry.inode);
+    node.flags |= INODE_UNLINKED;
+    update_inode(fs, node);
+    remove_mapping(fs, entry);
+    pthread_rwlock_unlock(&fs->inode_locks[entry.inode]);
+    pthread_rwlock_unlock(name_lock);
+    flush_metadata(fs);
+    return entry.inode;
+}
+
+/**
+ * Frees a file whose name sfs_unlink_r removed, releasing every block it holds. File
+ * descriptors still open on it fail until they are closed.
+ *
+ * @param fs The file system.
+ * @param inode Inode number of the file
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_iremove_r(sfs_t *fs, int inode)
+{
+    if (inode < 0 || inode >= MAX_DIRECTORIES)
+    {
+        print("File not found");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->inode_locks[inode]); // waits for the reads and writes under way
+    inode_s node = get_numbered_inode(fs, inode);
+    int status = node.uid == -1 || !(node.flags & INODE_UNLINKED) ? -1 : free_file(fs, inode);
+    pthread_rwlock_unlock(&fs->inode_locks[inode]);
+    if (status == -1)
+    {
+        print("File is not unlinked");
+        return -1;
+    }
+    flush_metadata(fs);
+    return 0;
+}
+
+/**
+ * Sets the size of a file, dropping the data and the blocks past the new end or growing the file
+ * with zeros. The tail of the last block kept is zeroed, since a later write past the end of the
+ * file expects whatever follows the end in its last block to read as zeros. The caller holds the
+ * inode lock exclusively.
+ *
+ * @param file The open inode of the file.
+ * @param length The new size of the file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int truncate_at(sfs_t *fs, open_inode *file, int length)
+{
+    inode_s node = *file->inode;
+    int size = file_size(fs, node);
+    if (length >= size)
+    { // a gap written past the end reads as zeros
+        return length == size || write_at(fs, file, "", 1, length - 1) != -1 ? 0 : -1;
+    }
+    delayed_data *d = &fs->delayed[node.uid];
+    long long base = allocated_bytes(fs, node);
+    if (d->blocks > 0 && length > base)
+    { // the new end is still in the delayed blocks, the ones past it are dropped
+        int blocks = blocks_for(length - base, BLOCK_SIZE);
+        memset(d->data + (length - base), 0, (size_t)blocks * BLOCK_SIZE - (length - base));
+        pthread_mutex_lock(&fs->alloc_lock);
+        fs->delayed_blocks -= d->blocks - blocks;
+        pthread_mutex_unlock(&fs->alloc_lock);
+        d->blocks = blocks;
+        d->size = length;
+        return 0;
+    }
+    drop_delayed_writes(fs, node.uid);
+    int status = 0;
+    if (length >= node.size)
+    { // the end moves within the last block, which is zeros past the old end
+        node.size = length;
+    }
+    else if (node.flags & INODE_INLINE)
+    {
+        memset(node.map.inline_data + length, 0, node.size - length);
+        node.size = length;
+    }
+    else if (length == 0)
+    { // back to where a new file starts out
+        int counter;
+        int *blocks_to_be_released = get_blocks(fs, node, &counter);
+        release_blocks(fs, blocks_to_be_released, counter);
+        free(blocks_to_be_released);
+        node.size = 0;
+        node.flags |= INODE_INLINE;
+        init_block_map(fs, &node);
+    }
+    else
+    {
+        int keep = blocks_for(length, BLOCK_SIZE);
+        int *map = file_block_map(fs, file, node, keep);
+        status = map == NULL || (length % BLOCK_SIZE != 0 && write_file_range(fs, map, keep, length, fs->empty_block, keep * BLOCK_SIZE - length) == -1) ? -1 : 0;
+        status = status == -1 || trim_blocks(fs, &node, keep, blocks_for(node.size, BLOCK_SIZE), true) == -1 ? -1 : 0;
+        node.size = status == 0 ? length : node.size;
+    }
+    pthread_mutex_lock(&file->lock);
+    int kept = node.flags & INODE_INLINE ? 0 : blocks_for(node.size, BLOCK_SIZE);
+    file->mapped = file->mapped < kept ? file->mapped : kept; // the rest of the block map pointed at the blocks released
+    pthread_mutex_unlock(&file->lock);
+    update_inode(fs, node);
+    return status;
+}
+
+/**
+ * Sets the size of a file. Whatever lies past the new size is dropped and its blocks released,
+ * and a file that grows reads as zeros past its old end. The file keeps its inode, so the
+ * descriptors and inode numbers that refer to it stay valid.
+ *
+ * @param fs The file system.
+ * @param fileID Id of the file
+ * @param length The new size of the file
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_ftruncate_r(sfs_t *fs, int fileID, int length)
+{
+    fdt_entry *entry = get_open_file(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    if (length < 0)
+    {
+        print("Invalid file size");
+        return -1;
+    }
+    open_inode *file = entry->file;
+    pthread_rwlock_wrlock(&fs->inode_locks[file->uid]); // waits for the reads and writes under way
+    if (file->inode == NULL)
+    { // removed meanwhile
+        pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    int status = truncate_at(fs, file, length);
+    pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    flush_metadata(fs);
+    if (status == -1)
+    {
+        print("Was unable to set the size of the file");
+    }
+    return status;
+}
+
+/**
+ * Gives the delayed blocks of a file their place on the disk without closing it, as closing it
+ * would. The blocks are durable only once synced.
+ *
+ * @param fs The file system.
+ * @param fileID Id of the file
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_fflush_r(sfs_t *fs, int fileID)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    open_inode *file = entry->file;
+    pthread_rwlock_wrlock(&fs->inode_locks[file->uid]);
+    int status = file->inode != NULL ? flush_delayed_writes(fs, file->uid) : -1;
+    pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    flush_metadata(fs);
+    if (status == -1)
+    {
+        print("Was unable to write the delayed blocks of the file");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes the data written to a file durable. Acts as a write barrier: every write issued to the
+ * file before the call reaches stable storage before it returns. Only the file is written back,
+ * its delayed blocks, its cached data and index blocks, then the changed metadata.
+ *
+ * @param fs The file system.
+ * @param fileID Id of the file
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_fsync_r(sfs_t *fs, int fileID)
+{
+    fdt_entry *entry = get_fd_entry(fs, fileID);
+    if (entry == NULL)
+    {
+        print("File entry does not exist. Please consider creating it.");
+        return -1;
+    }
+    open_inode *file = entry->file;
+    pthread_rwlock_wrlock(&fs->inode_locks[file->uid]);
+    int status = file->inode != NULL ? flush_delayed_writes(fs, file->uid) : -1;
+    if (status == 0)
+    {
+        int count;
+        int *blocks = get_blocks(fs, get_inode(fs, file->uid), &count);
+        status = cache_write_back(fs->cache, blocks, count);
+        free(blocks);
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[file->uid]);
+    if (status == -1 || flush_metadata(fs) == -1 || disk_sync(fs->disk) == -1)
+    {
+        print("Unable to sync file");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes every write issued so far durable.
+ *
+ * @param fs The file system.
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_sync_r(sfs_t *fs)
+{
+    fs->last_sync = time(NULL);
+    if (flush_all_delayed_writes(fs, -1) == -1 || cache_flush(fs->cache) == -1 || flush_metadata(fs) == -1 || disk_sync(fs->disk) == -1)
+    {
+        print("Unable to sync disk");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets how often the write path syncs on its own. Writes are otherwise only guaranteed
+ * durable after sfs_fsync or sfs_sync.
+ *
+ * @param fs The file system.
+ * @param seconds Seconds between automatic syncs, 0 to disable
+ */
+void sfs_set_sync_interval_r(sfs_t *fs, int seconds)
+{
+    fs->sync_interval = seconds;
+    fs->last_sync = time(NULL);
+}
+
+/**
+ * Sets how much memory the block cache may use. The cached blocks are written back and the cache
+ * starts over empty with the new budget.
+ *
+ * @param fs The file system.
+ * @param data_bytes Bytes of file data to keep, 0 to read and write data straight from the disk
+ * @param metadata_bytes Bytes of index blocks and extent tree nodes to keep, 0 to not cache them
+ * @return 0 if succesful -1 otherwise
+ */
+int sfs_set_cache_budget_r(sfs_t *fs, long data_bytes, long metadata_bytes)
+{
+    if (data_bytes < 0 || metadata_bytes < 0)
+    {
+        print("Invalid cache budget.");
+        return -1;
+    }
+    fs->data_cache_bytes = data_bytes;
+    fs->metadata_cache_bytes = metadata_bytes;
+    if (BLOCK_SIZE == 0)
+    { // applied once a file system is mounted
+        return 0;
+    }
+    if (cache_flush(fs->cache) == -1 || init_block_cache(fs) == -1)
+    {
+        print("Unable to resize the block cache.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets whether removing files punches holes in the disk image over the blocks they free, the
+ * image file equivalent of a TRIM. Off by default, freed blocks are then left as they are.
+ *
+ * @param fs The file system.
+ * @param enabled 1 to punch holes, 0 to leave freed blocks alone
+ */
+void sfs_set_discard_r(sfs_t *fs, int enabled)
+{
+    fs->discard_freed = enabled;
+}
+
+/**
+ * Retrieves the geometry of a mounted file system, as recorded in its super block.
+ *
+ * @param fs The file system.
+ * @param geometry Where the geometry goes
+ */
+void sfs_get_geometry_r(sfs_t *fs, sfs_geometry *geometry)
+{
+    geometry->block_size = fs->sb.block_size;
+    geometry->num_blocks = fs->sb.file_system_size;
+    geometry->num_inodes = fs->sb.inode_table_l;
+    geometry->block_mapping = fs->sb.block_mapping;
+}
+
+//------------------------------- Default File System -------------------------------//
+
+// The calls of a program with a single file system, in DEFAULT_DISK. Each one acts on the handle
+// mksfs mounts, see the call of the same name ending in _r for what it does.
+
+int mksfs(int fresh)
+{
+    return mksfs_geometry(fresh, &default_geometry);
+}
+
+int mksfs_geometry(int fresh, const sfs_geometry *geometry)
+{
+    return mount_fs(default_context(), DEFAULT_DISK, fresh, geometry);
+}
+
+int sfs_getnextfilename(char *fname)
+{
+    return sfs_getnextfilename_r(default_context(), fname);
+}
+
+int sfs_getfilesize(const char *path)
+{
+    return sfs_getfilesize_r(default_context(), path);
+}
+
+int sfs_fopen(char *name)
+{
+    return sfs_fopen_r(default_context(), name);
+}
+
+int sfs_fcreate(char *name)
+{
+    return sfs_fcreate_r(default_context(), name);
+}
+
+int sfs_fclose(int fileID)
+{
+    return sfs_fclose_r(default_context(), fileID);
+}
+
+int sfs_fwrite(int fileID, const char *buf, int length)
+{
+    return sfs_fwrite_r(default_context(), fileID, buf, length);
+}
+
+int sfs_fread(int fileID, char *buf, int length)
+{
+    return sfs_fread_r(default_context(), fileID, buf, length);
+}
+
+int sfs_pwrite(int fileID, const char *buf, int length, int loc)
+{
+    return sfs_pwrite_r(default_context(), fileID, buf, length, loc);
+}
+
+int sfs_pread(int fileID, char *buf, int length, int loc)
+{
+    return sfs_pread_r(default_context(), fileID, buf, length, loc);
+}
+
+int sfs_fseek(int fileId, int loc)
+{
+    return sfs_fseek_r(default_context(), fileId, loc);
+}
+
+int sfs_remove(char *file)
+{
+    return sfs_remove_r(default_context(), file);
+}
+
+int sfs_ftruncate(int fileID, int length)
+{
+    return sfs_ftruncate_r(default_context(), fileID, length);
+}
+
+int sfs_fflush(int fileID)
+{
+    return sfs_fflush_r(default_context(), fileID);
+}
+
+int sfs_fsync(int fileID)
+{
+    return sfs_fsync_r(default_context(), fileID);
+}
+
+int sfs_sync()
+{
+    return sfs_sync_r(default_context());
+}
+
+void sfs_set_sync_interval(int seconds)
+{
+    sfs_set_sync_interval_r(default_context(), seconds);
+}
+
+int sfs_set_cache_budget(long data_bytes, long metadata_bytes)
+{
+    return sfs_set_cache_budget_r(default_context(), data_bytes, metadata_bytes);
+}
+
+void sfs_set_discard(int enabled)
+{
+    sfs_set_discard_r(default_context(), enabled);
+}
@@ -3,7 +3,120 @@
 
 // You can add more into this file.
 
-void mksfs(int);
+// A file system is reached through the handle sfs_mount returns, with the calls ending in _r.
+// Handles share nothing, so one process can mount any number of images. The calls without
+// the suffix act on a single default file system that mksfs mounts.
+//
+// Every call is safe from several threads at once, except mksfs, mksfs_geometry,
+// sfs_unmount and the sfs_set_cache_budget calls, which have to run alone on their file
+// system. The read and write pointer of a file descriptor is not shared safely between
+// threads, sfs_pread and sfs_pwrite are.
+
+#define MAXFILENAME 17 // bytes of the longest file name, with its terminator
+
+#define SFS_MAP_POINTERS 0 // inodes map blocks with direct and indirect pointers
+#define SFS_MAP_EXTENTS 1  // inodes map blocks with an extent tree
+
+typedef struct sfs_geometry
+{
+    int block_size;    // bytes per block
+    int num_blocks;    // blocks in the disk image
+    int num_inodes;    // files the file system can hold
+    int block_mapping; // SFS_MAP_POINTERS or SFS_MAP_EXTENTS
+} sfs_geometry;
+
+typedef struct sfs_options
+{
+    int fresh;                 // 1 to create a new file system, 0 to open the one in the image
+    sfs_geometry geometry;     // geometry of a new file system
+    long data_cache_bytes;     // bytes of file data the block cache keeps
+    long metadata_cache_bytes; // bytes of index blocks and extent tree nodes the block cache keeps
+    int sync_interval;         // seconds between automatic syncs, 0 to disable
+    int discard;               // 1 to punch holes in the image over freed blocks
+    int disk_mode;             // how the image is reached, DISK_MODE_PIO or DISK_MODE_MMAP of disk_emu.h
+} sfs_options;
+
+typedef struct sfs sfs_t;
+
+// A run of file bytes, for callers that move data with splice instead of through a buffer.
+// The bytes are either in memory or at a position of the disk image.
+typedef struct sfs_extent
+{
+    char *mem;     // the bytes, NULL when they are in the image
+    int fd;        // the image holding the bytes when mem is NULL
+    long long pos; // position of the bytes in the image
+    int length;    // number of bytes
+} sfs_extent;
+
+// Moves the bytes of a list of extents and returns how many it moved, -1 on error. It runs with
+// the file locked, and the extents are only valid until it returns.
+typedef int (*sfs_extent_fn)(void *arg, sfs_extent *extents, int count);
+
+void sfs_default_options(sfs_options*);
+
+sfs_t *sfs_mount(char*, const sfs_options*);
+
+int sfs_unmount(sfs_t*);
+
+int sfs_getnextfilename_r(sfs_t*, char*);
+
+int sfs_getfilesize_r(sfs_t*, const char*);
+
+int sfs_fopen_r(sfs_t*, char*);
+
+int sfs_fcreate_r(sfs_t*, char*);
+
+int sfs_fclose_r(sfs_t*, int);
+
+int sfs_fwrite_r(sfs_t*, int, const char*, int);
+
+int sfs_fread_r(sfs_t*, int, char*, int);
+
+int sfs_pwrite_r(sfs_t*, int, const char*, int, int);
+
+int sfs_pread_r(sfs_t*, int, char*, int, int);
+
+int sfs_fseek_r(sfs_t*, int, int);
+
+int sfs_remove_r(sfs_t*, char*);
+
+int sfs_unlink_r(sfs_t*, char*);
+
+int sfs_iremove_r(sfs_t*, int);
+
+int sfs_fflush_r(sfs_t*, int);
+
+int sfs_fsync_r(sfs_t*, int);
+
+int sfs_sync_r(sfs_t*);
+
+void sfs_set_sync_interval_r(sfs_t*, int);
+
+int sfs_set_cache_budget_r(sfs_t*, long, long);
+
+void sfs_set_discard_r(sfs_t*, int);
+
+int sfs_lookup_r(sfs_t*, const char*);
+
+int sfs_getinodesize_r(sfs_t*, int);
+
+int sfs_getnextdirent_r(sfs_t*, int*, char*);
+
+int sfs_iopen_r(sfs_t*, int);
+
+int sfs_fileno_r(sfs_t*, int);
+
+int sfs_ftruncate_r(sfs_t*, int, int);
+
+void sfs_get_geometry_r(sfs_t*, sfs_geometry*);
+
+int sfs_pread_extents_r(sfs_t*, int, int, int, sfs_extent_fn, void*);
+
+int sfs_pwrite_extents_r(sfs_t*, int, int, int, sfs_extent_fn, void*);
+
+int mksfs(int);
+
+int mksfs_geometry(int, const sfs_geometry*);
 
 int sfs_getnextfilename(char*);
 
@@ -11,14 +124,34 @@ int sfs_getfilesize(const char*);
 
 int sfs_fopen(char*);
 
+int sfs_fcreate(char*);
+
 int sfs_fclose(int);
 
 int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
+int sfs_pwrite(int, const char*, int, int);
+
+int sfs_pread(int, char*, int, int);
+
 int sfs_fseek(int, int);
 
 int sfs_remove(char*);
 
+int sfs_ftruncate(int, int);
+
+int sfs_fflush(int);
+
+int sfs_fsync(int);
+
+int sfs_sync();
+
+void sfs_set_sync_interval(int);
+
+int sfs_set_cache_budget(long, long);
+
+void sfs_set_discard(int);
+
 #endif
@@ -0,0 +1,678 @@
+#include "sfs_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define EMPTY -1
+#define MIN_INDEX_CAPACITY 16
+#define BYPASS_FRACTION 4 // requests for more than a quarter of a pool go around it
+
+typedef struct cache_slot
+{
+    int address;    // disk block held, EMPTY when unused
+    int dirty;      // changed since it was read or last written back
+    int referenced; // CLOCK bit, set when the block is used again after it was loaded
+    int writing;    // a copy is being written back, the slot must not be reused meanwhile
+    char *data;
+} cache_slot;
+
+typedef struct cache_pool
+{
+    cache_slot *slots;
+    int first;    // number of the first slot of the pool
+    int capacity; // in blocks
+    int hand;     // next slot the CLOCK hand looks at
+    int writing;  // slots of the pool being written back
+    cache_stats stats;
+} cache_pool;
+
+struct block_cache
+{
+    disk_t *disk; // device the blocks are read from and written back to
+    cache_pool pools[CACHE_POOLS];
+    cache_slot *slots;    // every slot, the data pool first
+    char *arena;          // block contents of every slot
+    int *index_table;     // open addressing table from disk block to slot number
+    int index_capacity;   // always a power of two
+    int block_size;
+    int writing;          // slots being written back, in every pool
+    pthread_mutex_t lock; // guards everything above, released while a victim or a bypass goes to disk
+    pthread_cond_t written; // signalled whenever a write back finishes
+};
+
+/**
+ * Finds the bucket of the index holding a disk block, or the empty bucket where it would go.
+ *
+ * @param address The disk block to look for.
+ * @return The bucket position.
+ */
+static int find_bucket(block_cache *cache, int address)
+{
+    int mask = cache->index_capacity - 1;
+    int i = ((unsigned int)address * 2654435761u) & mask; // Fibonacci hashing
+    while (cache->index_table[i] != EMPTY && cache->slots[cache->index_table[i]].address != address)
+    {
+        i = (i + 1) & mask; // linear probing
+    }
+    return i;
+}
+
+/**
+ * Looks up the slot holding a disk block.
+ *
+ * @param address The disk block to look for.
+ * @return The slot number, or EMPTY if the block is not cached.
+ */
+static int find_slot(block_cache *cache, int address)
+{
+    return cache->index_capacity == 0 ? EMPTY : cache->index_table[find_bucket(cache, address)];
+}
+
+/**
+ * Removes a disk block from the index, shifting back the entries that probed past it so every
+ * entry stays reachable without tombstones.
+ *
+ * @param address The disk block to remove.
+ */
+static void index_remove(block_cache *cache, int address)
+{
+    int mask = cache->index_capacity - 1;
+    int i = find_bucket(cache, address);
+    if (cache->index_table[i] == EMPTY)
+    {
+        return;
+    }
+    cache->index_table[i] = EMPTY;
+    for (int j = (i + 1) & mask; cache->index_table[j] != EMPTY; j = (j + 1) & mask)
+    {
+        int home = ((unsigned int)cache->slots[cache->index_table[j]].address * 2654435761u) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        { // the hole lies on the probe path of the entry
+            cache->index_table[i] = cache->index_table[j];
+            cache->index_table[j] = EMPTY;
+            i = j;
+        }
+    }
+}
+
+/**
+ * Writes copies of dirty blocks back in one vectored request with the lock released. The blocks
+ * stay cached and readable meanwhile, and are marked as being written so no other thread reuses
+ * their slots or counts on the disk holding them yet. Called and returns with the lock held.
+ *
+ * @param numbers The dirty slots, none of them being written already.
+ * @param count Number of slots.
+ * @return 0 if successful, -1 otherwise.
+ */
+static int write_slots(block_cache *cache, const int *numbers, int count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    block_vec *vec = malloc(count * sizeof(block_vec));
+    char *copies = malloc((size_t)count * cache->block_size);
+    if (vec == NULL || copies == NULL)
+    {
+        free(vec);
+        free(copies);
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        cache_slot *slot = &cache->slots[numbers[i]];
+        vec[i].address = slot->address;
+        vec[i].buffer = copies + (size_t)i * cache->block_size;
+        memcpy(vec[i].buffer, slot->data, cache->block_size);
+        slot->dirty = 0; // set again by any write made while the copy is on its way
+        slot->writing = 1;
+        cache->pools[numbers[i] < cache->pools[CACHE_DATA].capacity ? CACHE_DATA : CACHE_METADATA].writing++;
+    }
+    cache->writing += count;
+    pthread_mutex_unlock(&cache->lock);
+    int status = disk_writev_blocks(cache->disk, vec, count) == -1 ? -1 : 0;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < count; i++)
+    {
+        cache_slot *slot = &cache->slots[numbers[i]];
+        cache_pool *pool = &cache->pools[numbers[i] < cache->pools[CACHE_DATA].capacity ? CACHE_DATA : CACHE_METADATA];
+        slot->writing = 0;
+        pool->writing--;
+        if (status == -1 && slot->address == vec[i].address)
+        {
+            slot->dirty = 1;
+        }
+        else if (status == 0)
+        {
+            pool->stats.write_backs++;
+        }
+    }
+    cache->writing -= count;
+    pthread_cond_broadcast(&cache->written);
+    free(copies);
+    free(vec);
+    return status;
+}
+
+/**
+ * Frees a slot of a pool with the CLOCK algorithm. The hand sweeps the pool, giving every block
+ * used since it last passed a second chance, and evicts the first block that was not. A dirty
+ * victim is written back before its slot is reused, without the lock, and is only evicted if it
+ * was not used again meanwhile.
+ *
+ * @param pool The pool to take the slot from, with at least one slot.
+ * @return The slot number, or -1 if the victim could not be written back.
+ */
+static int take_slot(block_cache *cache, cache_pool *pool)
+{
+    for (;;)
+    {
+        if (pool->writing == pool->capacity)
+        { // every slot is on its way to the disk
+            pthread_cond_wait(&cache->written, &cache->lock);
+            continue;
+        }
+        cache_slot *slot = &pool->slots[pool->hand];
+        int number = pool->first + pool->hand;
+        pool->hand = (pool->hand + 1) % pool->capacity;
+        if (slot->writing)
+        {
+            continue;
+        }
+        if (slot->address == EMPTY)
+        {
+            return number;
+        }
+        if (slot->referenced)
+        {
+            slot->referenced = 0;
+            continue;
+        }
+        if (slot->dirty)
+        {
+            if (write_slots(cache, &number, 1) == -1)
+            {
+                return -1;
+            }
+            if (slot->address == EMPTY)
+            { // discarded meanwhile
+                return number;
+            }
+            if (slot->dirty || slot->referenced)
+            { // used again meanwhile, it stays
+                continue;
+            }
+        }
+        index_remove(cache, slot->address);
+        slot->address = EMPTY;
+        slot->dirty = 0;
+        pool->stats.evictions++;
+        return number;
+    }
+}
+
+/**
+ * Loads a copy of a disk block into a pool, evicting another block if the pool is full. If
+ * another thread loaded the block while a victim was written back, its copy is kept: a dirty
+ * copy is overwritten with buffer, otherwise buffer gets the cached contents, which are at least
+ * as new as the disk.
+ *
+ * @param pool The pool to load the block into, with at least one slot.
+ * @param address The disk block, not cached yet.
+ * @param buffer The contents of the block.
+ * @param dirty Whether the copy is newer than the disk.
+ * @return The slot holding the block, or NULL if no slot could be freed.
+ */
+static cache_slot *install(block_cache *cache, cache_pool *pool, int address, void *buffer, int dirty)
+{
+    int number = take_slot(cache, pool);
+    if (number == -1)
+    {
+        return NULL;
+    }
+    int cached = find_slot(cache, address);
+    if (cached != EMPTY)
+    {
+        cache_slot *slot = &cache->slots[cached];
+        if (dirty)
+        {
+            memcpy(slot->data, buffer, cache->block_size);
+            slot->dirty = 1;
+        }
+        else
+        {
+            memcpy(buffer, slot->data, cache->block_size);
+        }
+        return slot;
+    }
+    cache_slot *slot = &cache->slots[number];
+    slot->address = address;
+    slot->dirty = dirty;
+    slot->referenced = 0; // a block read once is the first to go
+    memcpy(slot->data, buffer, cache->block_size);
+    cache->index_table[find_bucket(cache, address)] = number;
+    return slot;
+}
+
+/**
+ * Creates an empty cache in front of a disk. A pool without blocks passes every request
+ * straight to the disk.
+ *
+ * @param disk The disk the cache reads and writes back.
+ * @param block_size Size of a disk block in bytes.
+ * @param data_blocks Number of blocks the data pool holds.
+ * @param metadata_blocks Number of blocks the metadata pool holds.
+ * @return The cache, or NULL if it could not be allocated.
+ */
+block_cache *cache_init(disk_t *disk, int block_size, int data_blocks, int metadata_blocks)
+{
+    block_cache *cache = calloc(1, sizeof(block_cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->written, NULL);
+    cache->disk = disk;
+    int total = data_blocks + metadata_blocks;
+    int capacity = MIN_INDEX_CAPACITY;
+    while (capacity < total * 2)
+    {
+        capacity *= 2;
+    }
+    cache->slots = malloc(total * sizeof(cache_slot));
+    cache->arena = malloc((size_t)total * block_size);
+    cache->index_table = malloc(capacity * sizeof(int));
+    if ((total > 0 && (cache->slots == NULL || cache->arena == NULL)) || cache->index_table == NULL)
+    {
+        cache_free(cache);
+        return NULL;
+    }
+    for (int i = 0; i < total; i++)
+    {
+        cache->slots[i].address = EMPTY;
+        cache->slots[i].dirty = 0;
+        cache->slots[i].referenced = 0;
+        cache->slots[i].writing = 0;
+        cache->slots[i].data = cache->arena + (size_t)i * block_size;
+    }
+    memset(cache->index_table, 0xff, capacity * sizeof(int)); // every bucket EMPTY
+    cache->index_capacity = capacity;
+    cache->block_size = block_size;
+    cache->pools[CACHE_DATA].first = 0;
+    cache->pools[CACHE_DATA].capacity = data_blocks;
+    cache->pools[CACHE_METADATA].first = data_blocks;
+    cache->pools[CACHE_METADATA].capacity = metadata_blocks;
+    for (int p = 0; p < CACHE_POOLS; p++)
+    {
+        cache->pools[p].slots = cache->slots + cache->pools[p].first;
+    }
+    return cache;
+}
+
+/**
+ * Frees the cache without writing anything back. Dirty blocks have to be flushed first, and no
+ * other call on the cache may run meanwhile.
+ *
+ * @param cache The cache to free, NULL for none.
+ */
+void cache_free(block_cache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    free(cache->slots);
+    free(cache->arena);
+    free(cache->index_table);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->written);
+    free(cache);
+}
+
+/**
+ * Reads a block through the cache.
+ *
+ * @param cache The cache.
+ * @param pool CACHE_DATA or CACHE_METADATA.
+ * @param address The block to read.
+ * @param buffer Where the block goes.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_read(block_cache *cache, int pool, int address, void *buffer)
+{
+    block_vec vec = {address, buffer};
+    return cache_readv(cache, pool, &vec, 1);
+}
+
+/**
+ * Writes a block into the cache. It reaches the disk when it is evicted or flushed.
+ *
+ * @param cache The cache.
+ * @param pool CACHE_DATA or CACHE_METADATA.
+ * @param address The block to write.
+ * @param buffer The contents of the block.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_write(block_cache *cache, int pool, int address, const void *buffer)
+{
+    block_vec vec = {address, (void *)buffer};
+    return cache_writev(cache, pool, &vec, 1);
+}
+
+/**
+ * Reads blocks through the cache. The blocks that miss are fetched with one vectored request and
+ * kept. Requests too large for the pool are read around it, so a scan does not flush out the
+ * blocks in use, and only take the cached blocks that are newer than the disk. The disk is read
+ * without holding the cache lock, so other threads keep hitting the cache meanwhile.
+ *
+ * @param cache The cache.
+ * @param pool CACHE_DATA or CACHE_METADATA.
+ * @param vec The blocks to read and where each goes.
+ * @param count Number of blocks.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_readv(block_cache *cache, int pool, block_vec *vec, int count)
+{
+    cache_pool *p = &cache->pools[pool];
+    block_vec *misses = malloc(count * sizeof(block_vec));
+    int num_misses = 0;
+    pthread_mutex_lock(&cache->lock);
+    if (count > p->capacity / BYPASS_FRACTION)
+    { // the newer copies are taken before the disk is read, once written back they may be gone
+        for (int i = 0; i < count; i++)
+        {
+            int number = find_slot(cache, vec[i].address);
+            if (number != EMPTY && (cache->slots[number].dirty || cache->slots[number].writing))
+            {
+                memcpy(vec[i].buffer, cache->slots[number].data, cache->block_size);
+            }
+            else
+            {
+                misses[num_misses++] = vec[i];
+            }
+        }
+        p->stats.misses += num_misses;
+        pthread_mutex_unlock(&cache->lock);
+        int status = num_misses > 0 && disk_readv_blocks(cache->disk, misses, num_misses) == -1 ? -1 : 0;
+        free(misses);
+        return status;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int number = find_slot(cache, vec[i].address);
+        if (number != EMPTY)
+        {
+            memcpy(vec[i].buffer, cache->slots[number].data, cache->block_size);
+            cache->slots[number].referenced = 1;
+            p->stats.hits++;
+        }
+        else
+        {
+            misses[num_misses++] = vec[i];
+        }
+    }
+    p->stats.misses += num_misses;
+    pthread_mutex_unlock(&cache->lock);
+    int status = num_misses > 0 && disk_readv_blocks(cache->disk, misses, num_misses) == -1 ? -1 : 0;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < num_misses && status == 0; i++)
+    {
+        int number = find_slot(cache, misses[i].address);
+        if (number != EMPTY)
+        { // loaded by another thread meanwhile, its copy is at least as new as the disk
+            memcpy(misses[i].buffer, cache->slots[number].data, cache->block_size);
+        }
+        else if (install(cache, p, misses[i].address, misses[i].buffer, 0) == NULL)
+        {
+            status = -1;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(misses);
+    return status;
+}
+
+/**
+ * Writes blocks into the cache. Requests too large for the pool are written around it with one
+ * vectored request. The copies already cached are refreshed first and stay dirty until the disk
+ * has caught up, which happens without the cache lock.
+ *
+ * @param cache The cache.
+ * @param pool CACHE_DATA or CACHE_METADATA.
+ * @param vec The blocks to write and the contents of each.
+ * @param count Number of blocks.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_writev(block_cache *cache, int pool, block_vec *vec, int count)
+{
+    cache_pool *p = &cache->pools[pool];
+    int status = 0;
+    pthread_mutex_lock(&cache->lock);
+    if (count > p->capacity / BYPASS_FRACTION)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            int number;
+            while ((number = find_slot(cache, vec[i].address)) != EMPTY && cache->slots[number].writing)
+            { // an older copy is on its way to the disk and has to land first
+                pthread_cond_wait(&cache->written, &cache->lock);
+            }
+            if (number != EMPTY)
+            {
+                memcpy(cache->slots[number].data, vec[i].buffer, cache->block_size);
+                cache->slots[number].dirty = 1;
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+        if (disk_writev_blocks(cache->disk, vec, count) == -1)
+        { // the refreshed copies still reach the disk when they are written back
+            return -1;
+        }
+        pthread_mutex_lock(&cache->lock);
+        for (int i = 0; i < count; i++)
+        {
+            int number = find_slot(cache, vec[i].address);
+            if (number != EMPTY && !cache->slots[number].writing)
+            {
+                cache->slots[number].dirty = 0; // the disk has caught up
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    for (int i = 0; i < count && status == 0; i++)
+    {
+        int number = find_slot(cache, vec[i].address);
+        if (number == EMPTY)
+        {
+            status = install(cache, p, vec[i].address, vec[i].buffer, 1) == NULL ? -1 : 0;
+            continue;
+        }
+        memcpy(cache->slots[number].data, vec[i].buffer, cache->block_size);
+        cache->slots[number].dirty = 1;
+        cache->slots[number].referenced = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+/**
+ * Loads blocks into the cache ahead of use. The ones not cached yet are fetched with a single
+ * vectored request. At most a quarter of the pool is filled at a time, so read-ahead cannot push
+ * out the blocks in use.
+ *
+ * @param cache The cache.
+ * @param pool CACHE_DATA or CACHE_METADATA.
+ * @param addresses The blocks to load, in the order they will be read, -1 for none.
+ * @param count Number of blocks.
+ * @return Number of leading blocks of addresses the request covered, -1 on error.
+ */
+int cache_prefetch(block_cache *cache, int pool, const int *addresses, int count)
+{
+    cache_pool *p = &cache->pools[pool];
+    if (count > p->capacity / BYPASS_FRACTION)
+    {
+        count = p->capacity / BYPASS_FRACTION;
+    }
+    if (count <= 0)
+    {
+        return 0;
+    }
+    block_vec *vec = malloc(count * sizeof(block_vec));
+    char *buffers = malloc((size_t)count * cache->block_size);
+    int num_reads = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < count; i++)
+    {
+        if (addresses[i] >= 0 && find_slot(cache, addresses[i]) == EMPTY)
+        {
+            vec[num_reads].address = addresses[i];
+            vec[num_reads].buffer = buffers + (size_t)num_reads * cache->block_size;
+            num_reads++;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    int status = num_reads > 0 && disk_readv_blocks(cache->disk, vec, num_reads) == -1 ? -1 : count;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < num_reads && status != -1; i++)
+    {
+        cache_slot *slot = find_slot(cache, vec[i].address) == EMPTY ? install(cache, p, vec[i].address, vec[i].buffer, 0) : NULL;
+        if (slot == NULL)
+        {
+            status = find_slot(cache, vec[i].address) == EMPTY ? -1 : status;
+            continue;
+        }
+        slot->referenced = 1; // about to be read, it must not go before the blocks already read
+    }
+    if (status != -1)
+    {
+        p->stats.prefetched += num_reads;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(buffers);
+    free(vec);
+    return status;
+}
+
+/**
+ * Writes every dirty block back to the disk in a single vectored request. Blocks already on their
+ * way are waited for, so everything written before the call has reached the disk when it returns.
+ *
+ * @param cache The cache.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_flush(block_cache *cache)
+{
+    int total = cache->pools[CACHE_DATA].capacity + cache->pools[CACHE_METADATA].capacity;
+    int *numbers = malloc((total > 0 ? total : 1) * sizeof(int));
+    int count = 0;
+    pthread_mutex_lock(&cache->lock);
+    while (cache->writing > 0)
+    {
+        pthread_cond_wait(&cache->written, &cache->lock);
+    }
+    for (int i = 0; i < total; i++)
+    {
+        if (cache->slots[i].address != EMPTY && cache->slots[i].dirty)
+        {
+            numbers[count++] = i;
+        }
+    }
+    int status = write_slots(cache, numbers, count);
+    pthread_mutex_unlock(&cache->lock);
+    free(numbers);
+    return status;
+}
+
+/**
+ * Checks whether any of some blocks is being written back.
+ *
+ * @param addresses The blocks.
+ * @param count Number of blocks.
+ * @return 1 if one of them is on its way to the disk, 0 otherwise.
+ */
+static int in_flight(block_cache *cache, const int *addresses, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int number = find_slot(cache, addresses[i]);
+        if (number != EMPTY && cache->slots[number].writing)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes back the dirty copies of some blocks in a single vectored request, so the disk holds
+ * their latest contents, as for a file being synced or a caller that reaches the image without
+ * going through the cache.
+ *
+ * @param cache The cache.
+ * @param addresses The blocks to write back, each listed once.
+ * @param count Number of blocks.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_write_back(block_cache *cache, const int *addresses, int count)
+{
+    int *numbers = malloc((count > 0 ? count : 1) * sizeof(int));
+    int dirty = 0;
+    pthread_mutex_lock(&cache->lock);
+    while (in_flight(cache, addresses, count))
+    { // copies already on their way have to land before the call returns
+        pthread_cond_wait(&cache->written, &cache->lock);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int number = find_slot(cache, addresses[i]);
+        if (number != EMPTY && cache->slots[number].dirty)
+        {
+            numbers[dirty++] = number;
+        }
+    }
+    int status = write_slots(cache, numbers, dirty);
+    pthread_mutex_unlock(&cache->lock);
+    free(numbers);
+    return status;
+}
+
+/**
+ * Drops a block from the cache without writing it back, once its contents no longer matter. A
+ * write back already under way is waited for, so it cannot land on the block once it is reused.
+ *
+ * @param cache The cache.
+ * @param address The block to drop.
+ */
+void cache_discard(block_cache *cache, int address)
+{
+    pthread_mutex_lock(&cache->lock);
+    int number;
+    while ((number = find_slot(cache, address)) != EMPTY && cache->slots[number].writing)
+    {
+        pthread_cond_wait(&cache->written, &cache->lock);
+    }
+    if (number != EMPTY)
+    {
+        index_remove(cache, address);
+        cache->slots[number].address = EMPTY;
+        cache->slots[number].dirty = 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Returns the counters of a pool.
+ *
+ * @param cache The cache.
+ * @param pool CACHE_DATA or CACHE_METADATA.
+ * @return The counters accumulated since the cache was created.
+ */
+cache_stats cache_get_stats(block_cache *cache, int pool)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache_stats stats = cache->pools[pool].stats;
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
@@ -0,0 +1,40 @@
+#ifndef SFS_CACHE_H
+#define SFS_CACHE_H
+
+#include "disk_emu.h"
+
+// Write-back cache of disk blocks with CLOCK eviction. File data and the blocks that map it are
+// kept in separate pools with their own budgets, so streaming data cannot push out the mapping.
+// Each cache sits in front of one disk, so every mounted file system has its own. Every call
+// but cache_init and cache_free is safe from several threads. Callers must not read and write
+// the same block at the same time, which the file system ensures with its inode locks.
+
+#define CACHE_DATA 0     // file data blocks
+#define CACHE_METADATA 1 // index blocks and extent tree nodes
+#define CACHE_POOLS 2
+
+typedef struct block_cache block_cache;
+
+/* Counters of a pool accumulated since the cache was created */
+typedef struct cache_stats
+{
+    long hits;        // blocks read from the cache
+    long misses;      // blocks read from the disk
+    long evictions;   // blocks dropped to make room
+    long write_backs; // dirty blocks written to the disk, on eviction or flush
+    long prefetched;  // blocks read ahead of use
+} cache_stats;
+
+block_cache *cache_init(disk_t *disk, int block_size, int data_blocks, int metadata_blocks);
+void cache_free(block_cache *cache);
+int cache_read(block_cache *cache, int pool, int address, void *buffer);
+int cache_write(block_cache *cache, int pool, int address, const void *buffer);
+int cache_readv(block_cache *cache, int pool, block_vec *vec, int count);
+int cache_writev(block_cache *cache, int pool, block_vec *vec, int count);
+int cache_prefetch(block_cache *cache, int pool, const int *addresses, int count);
+int cache_flush(block_cache *cache);
+int cache_write_back(block_cache *cache, const int *addresses, int count);
+void cache_discard(block_cache *cache, int address);
+cache_stats cache_get_stats(block_cache *cache, int pool);
+
+#endif
@@ -0,0 +1,177 @@
+#include "sfs_dir.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CAPACITY 16
+
+/**
+ * Hashes a file name with 32-bit FNV-1a.
+ *
+ * @param name The file name to hash.
+ * @return The hash of the name.
+ */
+unsigned int dir_hash_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Finds the bucket holding the given name, or the empty bucket where it would go.
+ *
+ * @param index The index to search.
+ * @param name The file name to look for.
+ * @param hash The hash of the name.
+ * @return The bucket position.
+ */
+static int find_bucket(dir_hash *index, const char *name, unsigned int hash)
+{
+    int mask = index->capacity - 1;
+    int i = hash & mask;
+    while (index->entries[i].name != NULL)
+    {
+        if (index->entries[i].hash == hash && strcmp(index->entries[i].name, name) == 0)
+        {
+            break;
+        }
+        i = (i + 1) & mask; // linear probing
+    }
+    return i;
+}
+
+/**
+ * Rehashes every entry into a table of the given capacity.
+ *
+ * @param index The index to resize.
+ * @param capacity The new capacity, a power of two larger than the number of entries.
+ */
+static void resize(dir_hash *index, int capacity)
+{
+    dir_hash_entry *old = index->entries;
+    int old_capacity = index->capacity;
+    index->entries = calloc(capacity, sizeof(dir_hash_entry));
+    index->capacity = capacity;
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old[i].name != NULL)
+        {
+            index->entries[find_bucket(index, old[i].name, old[i].hash)] = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * Initializes an empty index sized for the given number of entries.
+ *
+ * @param index The index to initialize.
+ * @param expected Number of entries the index should hold without growing.
+ */
+void dir_hash_init(dir_hash *index, int expected)
+{
+    int capacity = MIN_CAPACITY;
+    while (capacity < expected * 2)
+    {
+        capacity *= 2;
+    }
+    index->entries = calloc(capacity, sizeof(dir_hash_entry));
+    index->capacity = capacity;
+    index->count = 0;
+}
+
+/**
+ * Releases the memory held by an index.
+ *
+ * @param index The index to free.
+ */
+void dir_hash_free(dir_hash *index)
+{
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+/**
+ * Adds a file to the index, or updates it if the name is already indexed. The name is not copied
+ * and has to stay valid for as long as it is indexed.
+ *
+ * @param index The index to add to.
+ * @param name The file name.
+ * @param slot The root directory slot of the file.
+ * @param inode The inode number of the file.
+ * @return 1 if the file was added, 0 if an existing entry was updated.
+ */
+int dir_hash_insert(dir_hash *index, const char *name, int slot, int inode)
+{
+    if ((index->count + 1) * 2 > index->capacity)
+    { // keep the load factor at or under one half
+        resize(index, index->capacity * 2);
+    }
+    unsigned int hash = dir_hash_name(name);
+    int i = find_bucket(index, name, hash);
+    int added = index->entries[i].name == NULL;
+    index->entries[i].name = name;
+    index->entries[i].hash = hash;
+    index->entries[i].slot = slot;
+    index->entries[i].inode = inode;
+    index->count += added;
+    return added;
+}
+
+/**
+ * Looks a file up by name.
+ *
+ * @param index The index to search.
+ * @param name The file name.
+ * @return The entry of the file, or NULL if it is not indexed.
+ */
+dir_hash_entry *dir_hash_lookup(dir_hash *index, const char *name)
+{
+    if (index->entries == NULL)
+    {
+        return NULL;
+    }
+    int i = find_bucket(index, name, dir_hash_name(name));
+    return index->entries[i].name != NULL ? &index->entries[i] : NULL;
+}
+
+/**
+ * Removes a file from the index. Entries further along the probe sequence are shifted back so
+ * lookups never need tombstones.
+ *
+ * @param index The index to remove from.
+ * @param name The file name.
+ * @return 1 if the file was removed, 0 if it was not indexed.
+ */
+int dir_hash_remove(dir_hash *index, const char *name)
+{
+    if (index->entries == NULL)
+    {
+        return 0;
+    }
+    int mask = index->capacity - 1;
+    int hole = find_bucket(index, name, dir_hash_name(name));
+    if (index->entries[hole].name == NULL)
+    {
+        return 0;
+    }
+    for (int i = (hole + 1) & mask; index->entries[i].name != NULL; i = (i + 1) & mask)
+    {
+        int home = index->entries[i].hash & mask;
+        // move the entry back unless its home bucket lies cyclically in (hole, i]
+        if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i))
+        {
+            index->entries[hole] = index->entries[i];
+            hole = i;
+        }
+    }
+    index->entries[hole].name = NULL;
+    index->count--;
+    return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef SFS_DIR_H
+#define SFS_DIR_H
+
+// Open addressing hash index from file name to root directory slot and inode number.
+
+typedef struct dir_hash_entry
+{
+    const char *name;  // points at the file name stored in the directory slot, NULL when empty
+    unsigned int hash;
+    int slot;          // root directory slot
+    int inode;         // inode table index
+} dir_hash_entry;
+
+typedef struct dir_hash
+{
+    dir_hash_entry *entries;
+    int capacity; // always a power of two
+    int count;
+} dir_hash;
+
+unsigned int dir_hash_name(const char *name);
+void dir_hash_init(dir_hash *index, int expected);
+void dir_hash_free(dir_hash *index);
+int dir_hash_insert(dir_hash *index, const char *name, int slot, int inode);
+dir_hash_entry *dir_hash_lookup(dir_hash *index, const char *name);
+int dir_hash_remove(dir_hash *index, const char *name);
+
+#endif
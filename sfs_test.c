@@ -1,8 +1,170 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "sfs_api.h"
+#include "sfs_cache.h"
+#include "disk_emu.h"
+
+#define TEST_BLOCK_SIZE 1024
+#define TEST_FILE_SIZE (300 * TEST_BLOCK_SIZE) // past the 12 direct blocks and the single indirect block
+
+static int failures = 0;
+
+static void check(const char *what, int ok) {
+    printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+static void fill(char *buf, int length, int seed) {
+    for (int i = 0; i < length; i++) {
+        buf[i] = (char)((i * 31 + seed) % 251 + 1);
+    }
+}
+
+static sfs_t *mount_image(char *path, int fresh, int mapping) {
+    sfs_options opts;
+    sfs_default_options(&opts);
+    opts.fresh = fresh;
+    opts.geometry.block_size = TEST_BLOCK_SIZE;
+    opts.geometry.num_blocks = 4096;
+    opts.geometry.block_mapping = mapping;
+    return sfs_mount(path, &opts);
+}
+
+// reads the whole file back and compares it with what it should hold
+static int same_file(sfs_t *fs, char *name, const char *expected, int length) {
+    if (sfs_getfilesize_r(fs, name) != length) {
+        return 0;
+    }
+    char *buf = malloc(length + 1);
+    int f = sfs_fopen_r(fs, name);
+    int ok = sfs_pread_r(fs, f, buf, length + 1, 0) == length && memcmp(buf, expected, length) == 0;
+    sfs_fclose_r(fs, f);
+    free(buf);
+    return ok;
+}
+
+// copies extents handed out by sfs_pread_extents_r into the buffer behind arg
+static int copy_extents(void *arg, sfs_extent *extents, int count) {
+    char **dst = arg;
+    int moved = 0;
+    for (int i = 0; i < count; i++) {
+        if (extents[i].mem != NULL) {
+            memcpy(*dst, extents[i].mem, extents[i].length);
+        } else if (pread(extents[i].fd, *dst, extents[i].length, extents[i].pos) != extents[i].length) {
+            return -1;
+        }
+        *dst += extents[i].length;
+        moved += extents[i].length;
+    }
+    return moved;
+}
+
+// writes, overwrites, truncates and unlinks files of one block mapping across remounts
+static void test_mapping(char *path, int mapping, const char *label) {
+    char what[128];
+    char *expected = calloc(TEST_FILE_SIZE, 1);
+    char *chunk = malloc(TEST_FILE_SIZE);
+    sfs_t *fs = mount_image(path, 1, mapping);
+
+    // appends in pieces that straddle the block and indirect boundaries
+    int f = sfs_fopen_r(fs, "big");
+    fill(expected, TEST_FILE_SIZE, 7);
+    int written = 0;
+    for (int at = 0; at < TEST_FILE_SIZE; at += 1000) {
+        int length = TEST_FILE_SIZE - at < 1000 ? TEST_FILE_SIZE - at : 1000;
+        written += sfs_fwrite_r(fs, f, expected + at, length);
+    }
+    snprintf(what, sizeof(what), "%s: append across indirect blocks", label);
+    check(what, written == TEST_FILE_SIZE && same_file(fs, "big", expected, TEST_FILE_SIZE));
+
+    // overwrites over the end of the direct blocks and of the single indirect block
+    int overwrites[] = {12 * TEST_BLOCK_SIZE - 100, 268 * TEST_BLOCK_SIZE - 500, 5 * TEST_BLOCK_SIZE + 3};
+    int ok = 1;
+    for (int i = 0; i < 3; i++) {
+        fill(chunk, 2000, 100 + i);
+        ok &= sfs_pwrite_r(fs, f, chunk, 2000, overwrites[i]) == 2000;
+        memcpy(expected + overwrites[i], chunk, 2000);
+    }
+    sfs_fclose_r(fs, f);
+    snprintf(what, sizeof(what), "%s: overwrite across block boundaries", label);
+    check(what, ok && same_file(fs, "big", expected, TEST_FILE_SIZE));
+
+    sfs_unmount(fs);
+    fs = mount_image(path, 0, mapping);
+    snprintf(what, sizeof(what), "%s: remount keeps the file", label);
+    check(what, fs != NULL && same_file(fs, "big", expected, TEST_FILE_SIZE));
+
+    // the same bytes through the extents handed to splice
+    char *out = calloc(TEST_FILE_SIZE, 1);
+    char *cursor = out;
+    f = sfs_fopen_r(fs, "big");
+    int moved = sfs_pread_extents_r(fs, f, TEST_FILE_SIZE, 0, copy_extents, &cursor);
+    snprintf(what, sizeof(what), "%s: read through extents", label);
+    check(what, moved == TEST_FILE_SIZE && memcmp(out, expected, TEST_FILE_SIZE) == 0);
+
+    // shrinks into the direct blocks, then grows back past them with zeros
+    int shrunk = 12 * TEST_BLOCK_SIZE + 10;
+    ok = sfs_ftruncate_r(fs, f, shrunk) == 0 && same_file(fs, "big", expected, shrunk);
+    memset(expected + shrunk, 0, TEST_FILE_SIZE - shrunk);
+    ok &= sfs_ftruncate_r(fs, f, 40 * TEST_BLOCK_SIZE) == 0;
+    sfs_fclose_r(fs, f);
+    sfs_unmount(fs);
+    fs = mount_image(path, 0, mapping);
+    snprintf(what, sizeof(what), "%s: truncate shrink and grow", label);
+    check(what, ok && same_file(fs, "big", expected, 40 * TEST_BLOCK_SIZE));
+
+    // an unlinked file stays readable while open, and the next mount frees it
+    fill(chunk, 5000, 3);
+    f = sfs_fopen_r(fs, "gone");
+    sfs_fwrite_r(fs, f, chunk, 5000);
+    int inode = sfs_unlink_r(fs, "gone");
+    memset(out, 0, 5000);
+    ok = inode != -1 && sfs_getfilesize_r(fs, "gone") == -1;
+    ok &= sfs_pread_r(fs, f, out, 5000, 0) == 5000 && memcmp(out, chunk, 5000) == 0;
+    sfs_fclose_r(fs, f);
+    snprintf(what, sizeof(what), "%s: read an unlinked file still open", label);
+    check(what, ok);
+    sfs_unmount(fs);
+    fs = mount_image(path, 0, mapping);
+    snprintf(what, sizeof(what), "%s: remount reclaims the unlinked file", label);
+    check(what, fs != NULL && sfs_iopen_r(fs, inode) == -1 && same_file(fs, "big", expected, 40 * TEST_BLOCK_SIZE));
+
+    sfs_unmount(fs);
+    remove(path);
+    free(out);
+    free(chunk);
+    free(expected);
+}
+
+// fills a cache of four data blocks with eight dirty blocks, so half are written back on eviction
+static void test_cache_eviction(void) {
+    char block[512], out[512];
+    disk_t *disk = disk_new();
+    disk_init_fresh(disk, "sfs_test_cache.sfs", sizeof(block), 64, DISK_MODE_PIO);
+    block_cache *cache = cache_init(disk, sizeof(block), 4, 1);
+    for (int i = 0; i < 8; i++) {
+        fill(block, sizeof(block), i);
+        cache_write(cache, CACHE_DATA, i, block);
+    }
+    cache_stats stats = cache_get_stats(cache, CACHE_DATA);
+    check("cache: dirty blocks written back on eviction", stats.evictions == 4 && stats.write_backs == 4);
+
+    cache_flush(cache);
+    stats = cache_get_stats(cache, CACHE_DATA);
+    int ok = stats.write_backs == 8;
+    for (int i = 0; i < 8; i++) {
+        fill(block, sizeof(block), i);
+        ok &= disk_read_blocks(disk, i, 1, out) != -1 && memcmp(out, block, sizeof(block)) == 0;
+    }
+    check("cache: flush leaves every block on the disk", ok);
+
+    cache_free(cache);
+    disk_free(disk);
+    remove("sfs_test_cache.sfs");
+}
 
 int main() {
     mksfs(1);
@@ -15,4 +177,23 @@ int main() {
     printf("%s\n", out_data);
     sfs_fclose(f);
     sfs_remove("some_name.txt");
+
+    // the same round trip through an image mapped into memory
+    sfs_options opts;
+    sfs_default_options(&opts);
+    opts.fresh = 1;
+    opts.disk_mode = DISK_MODE_MMAP;
+    sfs_t *mapped = sfs_mount("sfs_test_mmap.sfs", &opts);
+    f = sfs_fopen_r(mapped, "some_name.txt");
+    sfs_fwrite_r(mapped, f, my_data, sizeof(my_data));
+    memset(out_data, 0, sizeof(out_data));
+    sfs_pread_r(mapped, f, out_data, sizeof(my_data), 0);
+    printf("%s\n", strcmp(out_data, my_data) == 0 ? "Read back the same through the mapped disk" : "Mapped disk read back something else");
+    sfs_fclose_r(mapped, f);
+    sfs_unmount(mapped);
+
+    test_mapping("sfs_test_pointers.sfs", SFS_MAP_POINTERS, "pointers");
+    test_mapping("sfs_test_extents.sfs", SFS_MAP_EXTENTS, "extents");
+    test_cache_eviction();
+    return failures != 0;
 }